@@ -258,11 +258,8 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
   /* 6      | bDataBits  |   1   | Number Data bits (5, 6, 7, 8 or 16).          */
   /*******************************************************************************/
     case CDC_SET_LINE_CODING:
-
-    break;
-
     case CDC_GET_LINE_CODING:
-
+      ser_usb_line_coding(cmd, pbuf);
     break;
 
     case CDC_SET_CONTROL_LINE_STATE:
@@ -310,9 +307,10 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
       while (true);
   }
   usb_rx_cnt++;
-  list_put_it(&cdc_rx_head, &cdc_rx_buf->node);
+  lat_stamp(cdc_rx_buf->t_rx);
+  spsc_put(&cdc_rx_ring, cdc_rx_buf); // never full, as the pool
 
-  cdc_rx_buf = list_get_entry_it(&cdc_rx_free_head, cdc_buf_t);
+  cdc_rx_buf = spsc_get(&cdc_rx_free_ring);
   if (!cdc_rx_buf) {
       d_verbose("CDC_Receive_FS: no free buf\n");
       return USBD_OK;
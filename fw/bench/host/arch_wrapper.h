@@ -0,0 +1,54 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// host replacement of cdnet/arch/stm32/arch_wrapper.h
+
+#ifndef __ARCH_WRAPPER_H__
+#define __ARCH_WRAPPER_H__
+
+typedef struct {
+    GPIO_TypeDef *group;
+    uint16_t num;
+} gpio_t;
+
+static inline void gpio_set_value(gpio_t *gpio, bool value)
+{
+    if (value)
+        gpio->group->ODR |= gpio->num;
+    else
+        gpio->group->ODR &= ~gpio->num;
+}
+
+static inline bool gpio_get_value(gpio_t *gpio)
+{
+    return !!(gpio->group->ODR & gpio->num);
+}
+
+typedef struct {
+    UART_HandleTypeDef *huart;
+} uart_t;
+
+typedef struct {
+    SPI_HandleTypeDef *hspi;
+    gpio_t *ns_pin;
+} spi_t;
+
+// systick in ms, as on the target
+#define SYSTICK_US_DIV  1000
+uint32_t get_systick(void);
+
+// count the critical sections instead of masking anything
+extern uint32_t host_irq_off_cnt;
+
+#define local_irq_save(flags)       do { (flags) = 0; host_irq_off_cnt++; } while (0)
+#define local_irq_restore(flags)    do { (void)(flags); } while (0)
+#define local_irq_enable()          do {} while (0)
+#define local_irq_disable()         do { host_irq_off_cnt++; } while (0)
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// host replacement of Inc/main.h and the small part of the STM32 HAL
+// used by usr/, only for the host-bench build
+
+#ifndef __MAIN_H__
+#define __MAIN_H__
+
+#include <stdint.h>
+
+#define __IO volatile
+
+typedef struct {
+    __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t SR;
+    __IO uint32_t DR;
+} USART_TypeDef;
+
+typedef struct {
+    __IO uint32_t CNDTR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+    DMA_Channel_TypeDef *Instance;
+} DMA_HandleTypeDef;
+
+typedef enum {
+    HAL_UART_STATE_RESET = 0x00,
+    HAL_UART_STATE_READY = 0x20,
+    HAL_UART_STATE_BUSY_TX = 0x21
+} HAL_UART_StateTypeDef;
+
+typedef struct {
+    uint32_t BaudRate;
+} UART_InitTypeDef;
+
+typedef struct {
+    USART_TypeDef *Instance;
+    UART_InitTypeDef Init;
+    DMA_HandleTypeDef *hdmarx;
+    __IO uint16_t TxXferCount;
+    __IO HAL_UART_StateTypeDef gState;
+} UART_HandleTypeDef;
+
+typedef struct { int dummy; } SPI_HandleTypeDef;
+typedef struct { int dummy; } ADC_HandleTypeDef;
+
+typedef enum {
+    HAL_OK = 0,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+    uint32_t TypeErase;
+    uint32_t PageAddress;
+    uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+#define FLASH_TYPEERASE_PAGES   0
+#define FLASH_TYPEPROGRAM_HALFWORD 1
+#define FLASH_TYPEPROGRAM_WORD  2
+#define FLASH_PAGE_SIZE         0x800
+
+#define UART_FLAG_TXE           0x80
+#define UART_FLAG_TC            0x40
+#define UART_FLAG_IDLE          0x10
+#define UART_FLAG_ORE           0x08
+#define UART_FLAG_NE            0x04
+#define UART_FLAG_FE            0x02
+#define UART_FLAG_PE            0x01
+#define UART_IT_IDLE            0x10
+#define UART_IT_TC              0x40
+#define __HAL_UART_GET_FLAG(h, f)   (((h)->Instance->SR & (f)) == (f))
+#define __HAL_UART_CLEAR_PEFLAG(h)  ((h)->Instance->SR &= ~0x1f)
+#define __HAL_UART_CLEAR_IDLEFLAG(h) __HAL_UART_CLEAR_PEFLAG(h)
+#define __HAL_UART_ENABLE_IT(h, i)  ((void)(h))
+#define __HAL_UART_DISABLE_IT(h, i) ((void)(h))
+#define __HAL_UART_GET_IT_SOURCE(h, i) 0
+
+// the host dma raises the tc callback at once
+#define __HAL_DMA_GET_TC_FLAG_INDEX(h)  0
+#define __HAL_DMA_GET_FLAG(h, f)        0
+
+// CYCCNT reads the host clock in 72 MHz cycles
+typedef struct {
+    uint32_t CYCCNT;
+} DWT_Type;
+DWT_Type *host_dwt(void);
+#define DWT                     (host_dwt())
+extern uint32_t SystemCoreClock;
+
+extern GPIO_TypeDef host_gpio;
+extern uint8_t host_uid[12];
+#define UID_BASE                ((uintptr_t)host_uid)
+
+#define LED_R_GPIO_Port         (&host_gpio)
+#define LED_R_Pin               (1 << 0)
+#define LED_G_GPIO_Port         (&host_gpio)
+#define LED_G_Pin               (1 << 1)
+#define LED_B_GPIO_Port         (&host_gpio)
+#define LED_B_Pin               (1 << 2)
+#define LED_TX_GPIO_Port        (&host_gpio)
+#define LED_TX_Pin              (1 << 3)
+#define LED_RX_GPIO_Port        (&host_gpio)
+#define LED_RX_Pin              (1 << 4)
+#define SW_MODE_GPIO_Port       (&host_gpio)
+#define SW_MODE_Pin             (1 << 5)
+#define CDCTL_RST_N_GPIO_Port   (&host_gpio)
+#define CDCTL_RST_N_Pin         (1 << 6)
+#define CDCTL_INT_N_GPIO_Port   (&host_gpio)
+#define CDCTL_INT_N_Pin         (1 << 7)
+#define CDCTL_NS_GPIO_Port      (&host_gpio)
+#define CDCTL_NS_Pin            (1 << 8)
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+        uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+        uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart);
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram,
+        uint32_t Address, uint64_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit,
+        uint32_t *PageError);
+
+void NVIC_SystemReset(void);
+#define __WFI()                 do {} while (0)
+
+#endif
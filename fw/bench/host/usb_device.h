@@ -0,0 +1,44 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// host replacement of Inc/usb_device.h
+
+#ifndef __USB_DEVICE__H__
+#define __USB_DEVICE__H__
+
+#include <stdint.h>
+
+#define USBD_STATE_DEFAULT      1
+#define USBD_STATE_ADDRESSED    2
+#define USBD_STATE_CONFIGURED   3
+#define USBD_STATE_SUSPENDED    4
+
+#define USBD_OK                 0
+#define USBD_BUSY               1
+#define USBD_FAIL               2
+
+typedef struct {
+    uint8_t *RxBuffer;
+    uint8_t *TxBuffer;
+    uint32_t TxLength;
+    volatile uint32_t TxState;
+    volatile uint32_t RxState;
+} USBD_CDC_HandleTypeDef;
+
+typedef struct {
+    volatile uint8_t dev_state;
+    void *pClassData;
+} USBD_HandleTypeDef;
+
+uint8_t USBD_CDC_SetTxBuffer(USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint16_t length);
+uint8_t USBD_CDC_SetRxBuffer(USBD_HandleTypeDef *pdev, uint8_t *pbuff);
+uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef *pdev);
+uint8_t USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev);
+
+#endif
@@ -0,0 +1,22 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// host replacement of Inc/usbd_cdc_if.h
+
+#ifndef __USBD_CDC_IF_H__
+#define __USBD_CDC_IF_H__
+
+#include "usb_device.h"
+
+#define CDC_SET_LINE_CODING     0x20
+#define CDC_GET_LINE_CODING     0x21
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+
+#endif
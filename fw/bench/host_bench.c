@@ -0,0 +1,285 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// drive the usr/ data path with synthetic traffic on the host:
+//   ./host_bench [bridge|raw] [frame_cnt]
+
+#include <time.h>
+#include <x86intrin.h>
+#include "app_main.h"
+#include "host_bench.h"
+
+static void (*app_routine)(void) = app_bridge;
+
+typedef struct {
+    const char  *name;
+    bool        (*feed)(int len);   // return false if nothing could be fed
+    uint64_t    (*done)(void);      // frames delivered so far
+} scenario_t;
+
+static uint8_t h_frame[260];
+static int h_frame_len;
+static int usb_ofs; // bytes of h_frame already sent by usb
+static uint64_t rs485_in_cnt;
+
+
+static void make_host_frame(int len)
+{
+    int i;
+    h_frame[0] = 0xaa;
+    h_frame[1] = 0x56;
+    h_frame[2] = len + 2;
+    h_frame[3] = 0x00;
+    h_frame[4] = 0x01;
+    for (i = 0; i < len; i++)
+        h_frame[5 + i] = i;
+    cduart_fill_crc(h_frame);
+    h_frame_len = h_frame[2] + 5;
+}
+
+static bool feed_uart(int len)
+{
+    bool ret = false;
+    while (host_uart_space() >= h_frame_len) {
+        host_uart_write(h_frame, h_frame_len);
+        ret = true;
+    }
+    return ret;
+}
+
+static bool feed_uart_raw(int len)
+{
+    int size = min(host_uart_space(), len);
+    if (size <= 0)
+        return false;
+    host_uart_write(h_frame, size);
+    return true;
+}
+
+static bool feed_usb(int len)
+{
+    bool ret = false;
+    while (true) {
+        int size = min(64, h_frame_len - usb_ofs);
+        if (!host_usb_write(h_frame + usb_ofs, size))
+            break;
+        usb_ofs += size;
+        if (usb_ofs == h_frame_len)
+            usb_ofs = 0;
+        ret = true;
+    }
+    return ret;
+}
+
+// both hosts at once, multi host mode
+static bool feed_multi(int len)
+{
+    bool ret = feed_uart(len);
+    return feed_usb(len) || ret;
+}
+
+static bool feed_rs485(int len)
+{
+    bool ret = false;
+    while (host_rs485_write(0x01, 0x00, h_frame, len)) {
+        rs485_in_cnt++;
+        ret = true;
+    }
+    return ret;
+}
+
+static uint64_t done_bus(void)
+{
+    return host_stat.bus_frames;
+}
+
+// frames which reached the fake links, by bytes: a copy a link dropped
+// never counts, each copy to several links in multi host mode does
+static uint64_t done_rs485(void)
+{
+    return host_stat.host_bytes / h_frame_len; // same size as the frame to the host
+}
+
+
+// bitwise crc16 of cdnet/utils/modbus_crc.c, which crc16_tbl.c replaces
+static uint16_t crc16_bit(const uint8_t *data, uint32_t length)
+{
+    uint16_t crc_val = 0xffff;
+    int i;
+
+    while (length--) {
+        crc_val ^= *data++;
+        for (i = 0; i < 8; i++)
+            crc_val = (crc_val & 1) ? (crc_val >> 1) ^ 0xa001 : crc_val >> 1;
+    }
+    return crc_val;
+}
+
+// the bitwise crc16 against the table-driven crc16()
+static void bench_crc(void)
+{
+    static uint8_t buf[258];
+    uint64_t c0, cyc_bit, cyc_tbl;
+    uint16_t crc_bit = 0, crc_tbl = 0;
+    int i, n = 20000;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = rand();
+
+    c0 = __rdtsc();
+    for (i = 0; i < n; i++)
+        crc_bit += crc16_bit(buf, sizeof(buf));
+    cyc_bit = __rdtsc() - c0;
+
+    c0 = __rdtsc();
+    for (i = 0; i < n; i++)
+        crc_tbl += crc16(buf, sizeof(buf));
+    cyc_tbl = __rdtsc() - c0;
+
+    printf("%-24s len %3d: bitwise %.2f cyc/byte, table %.2f cyc/byte%s\n",
+            "crc16", (int)sizeof(buf),
+            (double)cyc_bit / n / sizeof(buf), (double)cyc_tbl / n / sizeof(buf),
+            crc_bit == crc_tbl ? "" : " (MISMATCH)");
+}
+
+#ifdef LAT_PROF
+static void print_lat(void)
+{
+    static const char *names[] = { "rx->parse", "queue->cdctl", "cdctl->tx done",
+            "rs485 rx->host", "data pass" };
+    int i, b;
+
+    for (i = 0; i < LAT_STAGE_MAX; i++) {
+        lat_hist_t *h = &lat_hist[i];
+        uint32_t half = 0;
+        for (b = 0; b < LAT_BUCKETS && half < h->cnt / 2; b++)
+            half += h->bucket[b];
+        printf("lat %-16s cnt %8u, median < %u cyc, max %u cyc\n",
+                names[i], h->cnt, 2u << max(b - 1, 0), h->max);
+    }
+}
+#endif
+
+static void run(const scenario_t *s, int len, uint64_t cnt)
+{
+    struct timespec t0, t1;
+    uint64_t c0, cyc = 0, frames, loops = 0;
+    uint64_t bytes0 = host_stat.host_bytes + host_stat.bus_bytes;
+    uint64_t done0;
+    uint32_t irq0 = host_irq_off_cnt;
+
+    make_host_frame(len);
+    done0 = s->done();
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (s->done() - done0 < cnt) {
+        s->feed(len);
+        c0 = __rdtsc();
+        cdnet_intf_routine();
+        app_routine();
+        ser_tx_routine();
+        cyc += __rdtsc() - c0;
+        sw_timer_routine();
+        host_usb_complete();
+        if (++loops > cnt * 100) {
+            printf("%s: stalled after %lu frames\n",
+                    s->name, (unsigned long)(s->done() - done0));
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    // finish the frame on the wire and drain what is left,
+    // out of the measurement
+    while (usb_ofs) {
+        int size = min(64, h_frame_len - usb_ofs);
+        if (host_usb_write(h_frame + usb_ofs, size))
+            usb_ofs = (usb_ofs + size) % h_frame_len;
+        app_routine();
+        ser_tx_routine();
+        host_usb_complete();
+    }
+    while (link_primary()->tx_head.first && link_primary()->tx_head.len > 1) {
+        app_routine();
+        ser_tx_routine();
+        host_usb_complete();
+    }
+
+    frames = s->done() - done0;
+    double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    uint64_t bytes = host_stat.host_bytes + host_stat.bus_bytes - bytes0;
+    printf("%-24s len %3d: %9.0f frames/s, %7.2f MB/s, %6.0f cyc/frame, "
+            "%.2f frames/loop, %.2f irq-off/frame\n",
+            s->name, len, frames / sec, bytes / sec / 1e6,
+            (double)cyc / frames, (double)frames / loops,
+            (double)(host_irq_off_cnt - irq0) / frames);
+}
+
+
+int main(int argc, char *argv[])
+{
+    bool raw = argc > 1 && strcmp(argv[1], "raw") == 0;
+    uint64_t cnt = argc > 2 ? strtoul(argv[2], NULL, 0) : 200000;
+    int lens[] = { 16, 64, 248 };
+    int i;
+
+    static const scenario_t s_uart = { "bridge uart->rs485", feed_uart, done_bus };
+    static const scenario_t s_usb = { "bridge usb->rs485", feed_usb, done_bus };
+    static const scenario_t s_rs485 = { "bridge rs485->host", feed_rs485, done_rs485 };
+    static const scenario_t s_rs485_multi = { "bridge rs485->uart+usb", feed_rs485, done_rs485 };
+    static const scenario_t s_multi = { "bridge uart+usb->rs485", feed_multi, done_bus };
+    static const scenario_t s_raw = { "raw uart->rs485", feed_uart_raw, done_bus };
+    static const scenario_t s_raw_fan = { "raw uart->rs485 x3", feed_uart_raw, done_bus };
+
+    host_device_init();
+    common_service_init();
+
+    if (raw) {
+        app_conf.mode = APP_RAW;
+        app_routine = app_raw;
+        app_raw_init();
+        host_link_select(SER_TTL);
+        for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+            run(&s_raw, lens[i], cnt / 10);
+        app_conf.rpt_dst_num = 3;
+        run(&s_raw_fan, 248, cnt / 10);
+        return 0;
+    }
+
+    bench_crc();
+
+    app_conf.mode = APP_BRIDGE;
+    app_bridge_init();
+
+    host_link_select(SER_TTL);
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        run(&s_uart, lens[i], cnt);
+
+    host_link_select(SER_USB);
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        run(&s_usb, lens[i], cnt);
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        run(&s_rs485, lens[i], cnt);
+    printf("usb flush: full %u, pkt %u, deadline %u, zlp %u\n",
+            flush_stat.full_cnt, flush_stat.pkt_cnt,
+            flush_stat.deadline_cnt, flush_stat.zlp_cnt);
+
+    app_conf.multi_host = true;
+    host_links[SER_TTL].active = true;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        run(&s_multi, lens[i], cnt);
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+        run(&s_rs485_multi, lens[i], cnt);
+    printf("multi drop: usb %u, ttl %u\n",
+            host_links[SER_USB].tx_drop_cnt, host_links[SER_TTL].tx_drop_cnt);
+#ifdef LAT_PROF
+    print_lat();
+#endif
+    return 0;
+}
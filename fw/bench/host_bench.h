@@ -0,0 +1,31 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+#ifndef __HOST_BENCH_H__
+#define __HOST_BENCH_H__
+
+typedef struct {
+    uint64_t    bus_frames;     // frames put to cdctl tx
+    uint64_t    bus_bytes;
+    uint64_t    host_bytes;     // bytes sent to the host link
+} host_stat_t;
+
+extern host_stat_t host_stat;
+extern uint32_t host_irq_off_cnt;
+
+void host_device_init(void);
+
+void host_uart_write(const uint8_t *buf, int len);
+int host_uart_space(void);
+bool host_usb_write(const uint8_t *buf, int len);
+void host_usb_complete(void);
+void host_link_select(ser_idx_t idx);
+bool host_rs485_write(uint8_t src, uint8_t dst, const uint8_t *dat, int len);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// fake hardware for the host-bench build:
+//   - globals normally owned by usr/app_main.c
+//   - HAL uart / flash, usb cdc and cdctl replacements
+
+#include <time.h>
+#include "app_main.h"
+#include "host_bench.h"
+
+GPIO_TypeDef host_gpio = {0};
+uint8_t host_uid[12] = { 0xcd, 0xcd, 0x00, 0x01 };
+uint32_t host_irq_off_cnt = 0;
+uint32_t SystemCoreClock = 72000000;
+
+static USART_TypeDef host_usart = { .SR = UART_FLAG_TXE };
+static DMA_Channel_TypeDef host_dma_ch = {0};
+static DMA_HandleTypeDef host_hdma = { .Instance = &host_dma_ch };
+static UART_HandleTypeDef host_huart = {
+        .Instance = &host_usart, .hdmarx = &host_hdma,
+        .gState = HAL_UART_STATE_READY };
+static UART_HandleTypeDef host_huart_dbg = {
+        .Instance = &host_usart, .gState = HAL_UART_STATE_READY };
+
+uart_t debug_uart = { .huart = &host_huart_dbg };
+static uart_t host_uart = { .huart = &host_huart };
+
+static USBD_CDC_HandleTypeDef host_hcdc = {0};
+USBD_HandleTypeDef hUsbDeviceFS = {
+        .dev_state = USBD_STATE_CONFIGURED, .pClassData = &host_hcdc };
+
+static cdc_rx_buf_t cdc_rx_alloc[CDC_RX_MAX];
+static cdc_buf_t cdc_tx_alloc[CDC_TX_MAX];
+static void *cdc_rx_free_slot[CDC_RX_MAX + 1];
+spsc_t cdc_rx_free_ring = SPSC_INIT(cdc_rx_free_slot);
+list_head_t cdc_tx_free_head = {0};
+static void *cdc_rx_slot[CDC_RX_MAX + 1];
+spsc_t cdc_rx_ring = SPSC_INIT(cdc_rx_slot);
+cdc_rx_buf_t *cdc_rx_buf = NULL;
+
+static cd_frame_t frame_alloc[FRAME_MAX];
+list_head_t frame_free_head = {0};
+
+static cdnet_packet_t packet_alloc[PACKET_MAX];
+
+cdctl_dev_t r_dev = {0};
+cdnet_intf_t n_intf = {0};
+
+int usb_rx_cnt = 0;
+int usb_tx_cnt = 0;
+
+host_stat_t host_stat = {0};
+
+
+uint32_t get_systick(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+DWT_Type *host_dwt(void)
+{
+    static DWT_Type dwt;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    dwt.CYCCNT = ts.tv_sec * SystemCoreClock + ts.tv_nsec * (SystemCoreClock / 1000000) / 1000;
+    return &dwt;
+}
+
+void set_led_state(led_state_t state)
+{
+}
+
+
+// uart
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart,
+        uint8_t *pData, uint16_t Size)
+{
+    if (huart == &host_huart)
+        host_stat.host_bytes += Size;
+    huart->TxXferCount = 0; // complete at once
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+        uint8_t *pData, uint16_t Size)
+{
+    huart->hdmarx->Instance->CNDTR = Size;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart)
+{
+    return HAL_OK;
+}
+
+// the bench host talks on the ttl link
+void host_uart_write(const uint8_t *buf, int len)
+{
+    host_link_t *l = &host_links[SER_TTL];
+    uint32_t wd_pos = l->circ_buf_sz - host_dma_ch.CNDTR;
+    while (len--) {
+        l->circ_buf[wd_pos++] = *buf++;
+        if (wd_pos == l->circ_buf_sz) {
+            wd_pos = 0;
+            host_dma_ch.CNDTR = l->circ_buf_sz;
+            HAL_UART_RxCpltCallback(&host_huart);
+        }
+    }
+    host_dma_ch.CNDTR = l->circ_buf_sz - wd_pos;
+}
+
+int host_uart_space(void)
+{
+    host_link_t *l = &host_links[SER_TTL];
+    uint32_t wd_pos = l->circ_buf_sz - host_dma_ch.CNDTR;
+    return l->circ_buf_sz - 1 - (wd_pos - l->rd_pos + l->circ_buf_sz) % l->circ_buf_sz;
+}
+
+// make idx the only active link, as ser_link_routine() does
+void host_link_select(ser_idx_t idx)
+{
+    int i;
+    app_conf.ser_idx = idx;
+    for (i = 0; i < SER_LINK_MAX; i++)
+        host_links[i].active = i == idx;
+}
+
+
+// flash
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) { return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_Lock(void) { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram,
+        uint32_t Address, uint64_t Data)
+{
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit,
+        uint32_t *PageError)
+{
+    return HAL_OK;
+}
+
+void NVIC_SystemReset(void)
+{
+    exit(0);
+}
+
+
+// usb cdc
+
+uint8_t USBD_CDC_SetTxBuffer(USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint16_t length)
+{
+    host_hcdc.TxBuffer = pbuff;
+    host_hcdc.TxLength = length;
+    return USBD_OK;
+}
+
+uint8_t USBD_CDC_SetRxBuffer(USBD_HandleTypeDef *pdev, uint8_t *pbuff)
+{
+    host_hcdc.RxBuffer = pbuff;
+    return USBD_OK;
+}
+
+uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef *pdev)
+{
+    host_hcdc.RxState = 1;
+    return USBD_OK;
+}
+
+uint8_t USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev)
+{
+    host_hcdc.TxState = 1;
+    return USBD_OK;
+}
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
+{
+    if (host_hcdc.TxState != 0)
+        return USBD_BUSY;
+    usb_tx_cnt++;
+    host_stat.host_bytes += Len;
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, Buf, Len);
+    return USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+}
+
+// same as CDC_Receive_FS, return false if usb would NAK
+bool host_usb_write(const uint8_t *buf, int len)
+{
+    if (!cdc_rx_buf || !host_hcdc.RxState)
+        return false;
+    host_hcdc.RxState = 0;
+    memcpy(cdc_rx_buf->dat, buf, len);
+    cdc_rx_buf->len = len;
+    usb_rx_cnt++;
+    lat_stamp(cdc_rx_buf->t_rx);
+    spsc_put(&cdc_rx_ring, cdc_rx_buf);
+
+    cdc_rx_buf = spsc_get(&cdc_rx_free_ring);
+    if (!cdc_rx_buf)
+        return true;
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, cdc_rx_buf->dat);
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+    return true;
+}
+
+void host_usb_complete(void)
+{
+    host_hcdc.TxState = 0;
+}
+
+
+// cdctl: every frame put to tx is sent at once
+
+static cd_frame_t *host_cdctl_get_rx_frame(cd_dev_t *cd_dev)
+{
+    return list_get_entry_it(&r_dev.rx_head, cd_frame_t);
+}
+
+static void host_cdctl_put_free_frame(cd_dev_t *cd_dev, cd_frame_t *frame)
+{
+    list_put_it(r_dev.free_head, &frame->node);
+}
+
+static cd_frame_t *host_cdctl_get_free_frame(cd_dev_t *cd_dev)
+{
+    return list_get_entry_it(r_dev.free_head, cd_frame_t);
+}
+
+void cdctl_put_tx_frame(cd_dev_t *cd_dev, cd_frame_t *frame)
+{
+    r_dev.tx_cnt++;
+    host_stat.bus_frames++;
+    host_stat.bus_bytes += frame->dat[2];
+    list_put_it(r_dev.free_head, &frame->node);
+    lat_bus_isr();
+}
+
+void cdctl_dev_init(cdctl_dev_t *dev, list_head_t *free_head, uint8_t filter,
+        uint32_t baud_l, uint32_t baud_h, spi_t *spi, gpio_t *rst_n, gpio_t *int_n)
+{
+    dev->free_head = free_head;
+    dev->state = CDCTL_IDLE;
+    dev->int_n = int_n;
+    dev->cd_dev.get_rx_frame = host_cdctl_get_rx_frame;
+    dev->cd_dev.put_free_frame = host_cdctl_put_free_frame;
+    dev->cd_dev.get_free_frame = host_cdctl_get_free_frame;
+    dev->cd_dev.put_tx_frame = cdctl_put_tx_frame;
+}
+
+uint8_t cdctl_read_reg(cdctl_dev_t *dev, uint8_t reg)
+{
+    return app_conf.rs485_mac;
+}
+
+void cdctl_write_reg(cdctl_dev_t *dev, uint8_t reg, uint8_t val)
+{
+}
+
+void cdctl_set_baud_rate(cdctl_dev_t *dev, uint32_t low, uint32_t high)
+{
+}
+
+// host_rs485_write() does the rx
+void cdctl_int_isr(cdctl_dev_t *dev)
+{
+}
+
+// same as the rx path of cdctl_int_isr
+bool host_rs485_write(uint8_t src, uint8_t dst, const uint8_t *dat, int len)
+{
+    cd_frame_t *frm = list_get_entry_it(r_dev.free_head, cd_frame_t);
+    if (!frm) {
+        r_dev.rx_no_free_node_cnt++;
+        return false;
+    }
+    frm->dat[0] = src;
+    frm->dat[1] = dst;
+    frm->dat[2] = len;
+    memcpy(frm->dat + 3, dat, len);
+    r_dev.rx_cnt++;
+    list_put_it(&r_dev.rx_head, &frm->node);
+    lat_bus_isr();
+    return true;
+}
+
+
+void host_device_init(void)
+{
+    int i;
+    for (i = 0; i < CDC_RX_MAX; i++)
+        spsc_put(&cdc_rx_free_ring, &cdc_rx_alloc[i]);
+    for (i = 0; i < CDC_TX_MAX; i++)
+        list_put(&cdc_tx_free_head, &cdc_tx_alloc[i].node);
+    for (i = 0; i < FRAME_MAX; i++)
+        list_put(&frame_free_head, &frame_alloc[i].node);
+    for (i = 0; i < PACKET_MAX; i++)
+        list_put(&cdnet_free_pkts, &packet_alloc[i].node);
+
+    cdc_rx_buf = spsc_get(&cdc_rx_free_ring);
+    USBD_CDC_SetRxBuffer(&hUsbDeviceFS, cdc_rx_buf->dat);
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+
+    static gpio_t int_n = { .group = CDCTL_INT_N_GPIO_Port, .num = CDCTL_INT_N_Pin };
+    gpio_set_value(&int_n, 1); // no int pending
+    cdctl_dev_init(&r_dev, &frame_free_head, app_conf.rs485_mac,
+            app_conf.rs485_baudrate_low, app_conf.rs485_baudrate_high,
+            NULL, NULL, &int_n);
+    host_links[SER_TTL].uart = &host_uart;
+    ser_uart_rx_start(&host_links[SER_TTL], app_conf.ttl_baudrate);
+    sw_timer_init();
+}
@@ -62,6 +62,11 @@ defined in linker script */
 .word _sbss
 /* end address for the .bss section. defined in linker script */
 .word _ebss
+/* start address for the ramfunc section in flash, start and end in SRAM.
+defined in linker script */
+.word _siramfunc
+.word _sramfunc
+.word _eramfunc
 
 .equ  BootRAM, 0xF1E0F85F
 /**
@@ -78,6 +83,23 @@ defined in linker script */
   .type Reset_Handler, %function
 Reset_Handler:
 
+/* Copy the ramfunc section from flash to SRAM */
+  movs r1, #0
+  b LoopCopyRamfunc
+
+CopyRamfunc:
+  ldr r3, =_siramfunc
+  ldr r3, [r3, r1]
+  str r3, [r0, r1]
+  adds r1, r1, #4
+
+LoopCopyRamfunc:
+  ldr r0, =_sramfunc
+  ldr r3, =_eramfunc
+  adds r2, r0, r1
+  cmp r2, r3
+  bcc CopyRamfunc
+
 /* Copy the data segment initializers from flash to SRAM */
   movs r1, #0
   b LoopCopyDataInit
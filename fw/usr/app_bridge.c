@@ -9,129 +9,273 @@
 
 #include "app_main.h"
 
-static cduart_dev_t d_dev = {0}; // dummy interface for cdnet
-static cd_frame_t *d_conv_frame = NULL;
+static cduart_dev_t d_dev = {0}; // dummy interface for cdnet, fed by the host links
+
+static host_link_t *mac_link[256];      // link which sent last with this src mac
+static int rr_first = 0;                // link served first in host_to_bus()
+
+// frames to 0x55 waiting for a reply, oldest first: the reply goes to the
+// link of the first request from its dst mac to its port; requests
+// without a reply are overwritten once the ring wraps
+#define LOCAL_REQ_MAX   8
+
+typedef struct {
+    host_link_t *link;  // NULL: replied
+    uint8_t     mac;
+    uint8_t     port;
+} local_req_t;
+
+static local_req_t local_req[LOCAL_REQ_MAX];
+static uint32_t local_req_wr = 0;
+
+// frames to rs485 by class, handed to r_dev only when its tx queue is short,
+// so a high class frame waits at most for the frames already there
+#define BUS_TX_DEPTH    1
+
+prio_stat_t prio_stat[PRIO_CLASS_MAX] = {0};
+static list_head_t prio_head[PRIO_CLASS_MAX] = {0};
+static uint32_t prio_t_in[PRIO_CLASS_MAX][FRAME_MAX]; // in the order of prio_head
+static uint32_t prio_t_wr[PRIO_CLASS_MAX] = {0};
+static uint32_t prio_t_rd[PRIO_CLASS_MAX] = {0};
+
+// wrap at FRAME_MAX, which needs not be a power of 2
+static inline uint32_t prio_t_next(uint32_t *idx)
+{
+    uint32_t i = *idx;
+    *idx = (i + 1 == FRAME_MAX) ? 0 : i + 1;
+    return i;
+}
+
+
+static void parser_init(cduart_dev_t *dev)
+{
+    cduart_dev_init(dev, &frame_free_head);
+    dev->remote_filter[0] = 0xaa;
+    dev->remote_filter_len = 1;
+    dev->local_filter[0] = 0x55;
+    dev->local_filter[1] = 0x56;
+    dev->local_filter_len = 2;
+}
 
 void app_bridge_init(void)
 {
-    d_conv_frame = list_get_entry(&frame_free_head, cd_frame_t);
+    int i;
 
-    cduart_dev_init(&d_dev, &frame_free_head);
-    d_dev.remote_filter[0] = 0xaa;
-    d_dev.remote_filter_len = 1;
-    d_dev.local_filter[0] = 0x55;
-    d_dev.local_filter[1] = 0x56;
-    d_dev.local_filter_len = 2;
+    parser_init(&d_dev);
+    for (i = 0; i < SER_LINK_MAX; i++)
+        parser_init(&host_links[i].d_dev);
 
     cdnet_intf_init(&n_intf, &d_dev.cd_dev, 0, 0x55);
     cdnet_intf_register(&n_intf);
 }
 
-static void read_from_host(const uint8_t *buf, int size,
-        const uint8_t *wr, const uint8_t *rd)
+// fr: [src, dst, len, dat], dat[0] of cdnet level 0: [7]: 0, [6]: reply, [5:0]: port
+// 0xff: not level 0
+static uint8_t l0_port(const cd_frame_t *fr)
+{
+    if (!fr->dat[2] || (fr->dat[3] & 0x80))
+        return 0xff;
+    return fr->dat[3] & 0x3f;
+}
+
+static int prio_class(const cd_frame_t *fr)
+{
+    int i;
+
+    for (i = 0; i < PRIO_RULE_MAX; i++) {
+        const prio_rule_t *r = &app_conf.prio_rules[i];
+        if (r->mac == 0xff && r->port == 0xff)
+            continue;
+        if (r->mac != 0xff && r->mac != fr->dat[1])
+            continue;
+        if (r->port != 0xff && l0_port(fr) != r->port)
+            continue;
+        return PRIO_HIGH;
+    }
+    return PRIO_NORMAL;
+}
+
+static void bus_tx_put(cd_frame_t *fr)
+{
+    int c = prio_class(fr);
+    prio_t_in[c][prio_t_next(&prio_t_wr[c])] = get_cycles();
+    list_put(&prio_head[c], &fr->node);
+    prio_stat[c].depth = prio_head[c].len;
+    prio_stat[c].depth_max = max(prio_stat[c].depth_max, prio_stat[c].depth);
+}
+
+static void bus_tx_routine(void)
 {
-    list_node_t *pre, *cur;
+    if (ser_usb_baud_pending()) // let r_dev go idle for the new rate
+        return;
+
+    while (r_dev.tx_head.len < BUS_TX_DEPTH) {
+        cd_frame_t *fr = NULL;
+        uint32_t t_in, wait;
+        int c;
+
+        for (c = 0; c < PRIO_CLASS_MAX; c++) {
+            fr = list_get_entry(&prio_head[c], cd_frame_t);
+            if (fr)
+                break;
+        }
+        if (!fr)
+            return;
+
+        t_in = prio_t_in[c][prio_t_next(&prio_t_rd[c])];
+        wait = (get_cycles() - t_in) / US_TO_CYCLES(1);
+        prio_stat[c].cnt++;
+        prio_stat[c].wait_sum += wait;
+        prio_stat[c].wait_max = max(prio_stat[c].wait_max, wait);
+        prio_stat[c].depth = prio_head[c].len;
+        lat_since(LAT_BUS_QUEUE, t_in);
+        lat_bus_tx_put();
+        cdctl_put_tx_frame(&r_dev.cd_dev, fr);
+    }
+}
 
+static RAMFUNC void read_from_host(host_link_t *l, const uint8_t *buf, int size,
+        const uint8_t *wr, const uint8_t *rd)
+{
     if (rd > wr) {
-        cduart_rx_handle(&d_dev, rd, buf + size - rd);
+        cduart_rx_handle(&l->d_dev, rd, buf + size - rd);
         rd = buf;
     }
     if (rd < wr)
-        cduart_rx_handle(&d_dev, rd, wr - rd);
-
-    list_for_each(&d_dev.rx_head, pre, cur) {
-        cd_frame_t *fr_src = list_entry(cur, cd_frame_t);
-        if (fr_src->dat[1] == 0x56) {
-            memcpy(d_conv_frame->dat, fr_src->dat + 3, 2);
-            d_conv_frame->dat[2] = fr_src->dat[2] - 2;
-            memcpy(d_conv_frame->dat + 3, fr_src->dat + 5, d_conv_frame->dat[2]);
-
-            list_pick(&d_dev.rx_head, pre, cur);
-            cdctl_put_tx_frame(&r_dev.cd_dev, d_conv_frame);
-            d_conv_frame = fr_src;
-            cur = pre;
-        }
-    }
+        cduart_rx_handle(&l->d_dev, rd, wr - rd);
 }
 
-void app_bridge(void)
+// take one frame of each link in turn, so no host can hold the bus;
+// frames to 0x55 go to the cdnet interface, frames to 0x56 to rs485
+static void host_to_bus(void)
 {
-    // handle data exchange
-    uint32_t wd_pos = CIRC_BUF_SZ - hw_uart->huart->hdmarx->Instance->CNDTR;
-
-    if (app_conf.ser_idx == SER_USB) {
-        int size;
-        uint8_t *wr, *rd;
-        cdc_buf_t *bf = list_get_entry_it(&cdc_rx_head, cdc_buf_t);
-        if (bf) {
-            uint32_t flags;
-            size = bf->len + 1; // avoid scroll to begin
-            wr = bf->dat + bf->len;
-            rd = bf->dat;
-            read_from_host(bf->dat, size, wr, rd);
-
-            local_irq_save(flags);
-            list_put(&cdc_rx_free_head, &bf->node);
-            if (!cdc_rx_buf) {
-                cdc_rx_buf = list_get_entry(&cdc_rx_free_head, cdc_buf_t);
-                d_verbose("continue CDC Rx\n");
-                USBD_CDC_SetRxBuffer(&hUsbDeviceFS, cdc_rx_buf->dat);
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+    bool more = true;
+    int i;
+
+    while (more) {
+        more = false;
+        for (i = 0; i < SER_LINK_MAX; i++) {
+            host_link_t *l = &host_links[(rr_first + i) % SER_LINK_MAX];
+            cd_frame_t *fr_src = list_get_entry(&l->d_dev.rx_head, cd_frame_t);
+            if (!fr_src)
+                continue;
+            more = true;
+
+            if (fr_src->dat[1] != 0x56) {
+                local_req_t *q = &local_req[local_req_wr++ % LOCAL_REQ_MAX];
+                q->link = l;
+                q->mac = fr_src->dat[0];
+                q->port = l0_port(fr_src);
+                list_put(&d_dev.rx_head, &fr_src->node);
+                continue;
             }
-            local_irq_restore(flags);
+            if (fr_src->dat[2] < 2) {
+                list_put_it(r_dev.free_head, &fr_src->node);
+                continue;
+            }
+            mac_link[fr_src->dat[3]] = l;
+
+            // convert in place (drop 56 aa):
+            //   [aa, 56, len, src, dst, dat] -> [src, dst, len - 2, dat]
+            // cdctl always sends from dat[0], so the payload moves by 2 bytes
+            uint8_t len = fr_src->dat[2] - 2;
+            fr_src->dat[0] = fr_src->dat[3];
+            fr_src->dat[1] = fr_src->dat[4];
+            fr_src->dat[2] = len;
+            memmove(fr_src->dat + 3, fr_src->dat + 5, len);
+
+            bus_tx_put(fr_src);
         }
-    } else { // hw_uart
-        read_from_host(circ_buf, CIRC_BUF_SZ, circ_buf + wd_pos, circ_buf + rd_pos);
     }
-    rd_pos = wd_pos;
+    rr_first = (rr_first + 1) % SER_LINK_MAX;
+    bus_tx_routine();
+}
 
-    cdc_buf_t *bf = NULL;
-    if (!cdc_tx_head.last) {
-        bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
-        if (!bf) {
-            df_warn("no cdc_tx_free (tx idle)\n");
-            return;
-        }
-        bf->len = 0;
-        list_put(&cdc_tx_head, &bf->node);
-    } else {
-        bf = list_entry(cdc_tx_head.last, cdc_buf_t);
+static host_link_t *link_default(void)
+{
+    int i;
+    if (link_primary()->active)
+        return link_primary();
+    for (i = 0; i < SER_LINK_MAX; i++)
+        if (host_links[i].active)
+            return &host_links[i];
+    return link_primary();
+}
+
+// reserve len bytes at the link; false if the data path has to wait,
+// a copy of a frame to several links (may_drop) is dropped instead when
+// the link is out of its share
+static bool host_reserve(host_link_t *l, int len, cdc_buf_t **bf, bool may_drop)
+{
+    *bf = ser_tx_reserve(l, len);
+    if (*bf)
+        return true;
+    if (may_drop) {
+        l->tx_drop_cnt++;
+        return true;
     }
+    drain_stat.no_buf_cnt++;
+    return false;
+}
 
-    // send to host
-    if (d_dev.tx_head.first) { // send d_dev.tx_head
-        cd_frame_t *frm = list_entry(d_dev.tx_head.first, cd_frame_t);
+// link of the request a reply of the cdnet interface belongs to,
+// only taken out of the ring once the reply is sent
+static local_req_t *local_req_find(const cd_frame_t *frm)
+{
+    uint8_t port = l0_port(frm);
+    uint32_t i;
 
-        if (bf->len + frm->dat[2] + 5 > 512) {
-            bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
-            if (!bf) {
-                df_warn("no cdc_tx_free (d_dev)\n");
-                return;
-            }
-            bf->len = 0;
-            list_put(&cdc_tx_head, &bf->node);
-        }
+    for (i = local_req_wr - min(local_req_wr, LOCAL_REQ_MAX); i != local_req_wr; i++) {
+        local_req_t *q = &local_req[i % LOCAL_REQ_MAX];
+        if (q->link && q->mac == frm->dat[1] && q->port == port)
+            return q;
+    }
+    return NULL;
+}
+
+// a reply of the cdnet interface, to the link which asked
+static bool local_to_host(cd_frame_t *frm, int *bytes)
+{
+    local_req_t *q = local_req_find(frm);
+    host_link_t *l = q && q->link->active ? q->link : link_default();
+    int len = frm->dat[2] + 5;
+    cdc_buf_t *bf;
 
+    if (!host_reserve(l, len, &bf, false))
+        return false;
+    if (bf) {
         //df_verbose("local ret: 55, dat len %d\n", frm->dat[2]);
         cduart_fill_crc(frm->dat);
-        memcpy(bf->dat + bf->len, frm->dat, frm->dat[2] + 5);
-        bf->len += frm->dat[2] + 5;
+        memcpy(bf->dat + bf->len, frm->dat, len);
+        bf->len += len;
+        *bytes += len;
+    }
+    if (q)
+        q->link = NULL;
+    return true;
+}
 
-        list_get(&d_dev.tx_head);
-        list_put_it(r_dev.free_head, &frm->node);
+// a rs485 frame (add 56 aa), to the link which sent last from its dst mac,
+// or to all links for broadcast and unknown macs; only the copies to all
+// links may be dropped, a unicast waits for its link
+static bool bus_to_host(cd_frame_t *frm, int *bytes)
+{
+    host_link_t *to = frm->dat[1] != 0xff ? mac_link[frm->dat[1]] : NULL;
+    int len = frm->dat[2] + 7;
+    int i;
 
-    } else if (r_dev.rx_head.first) { // send rs485 data (add 56 aa)
-        cd_frame_t *frm = list_entry(r_dev.rx_head.first, cd_frame_t);
+    if (to && !to->active)
+        to = NULL;
 
-        if (bf->len + frm->dat[2] + 5 + 2 > 512) {
-            bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
-            if (!bf) {
-                d_warn("no cdc_tx_free (bridge)\n");
-                return;
-            }
-            bf->len = 0;
-            list_put(&cdc_tx_head, &bf->node);
-        }
+    for (i = 0; i < SER_LINK_MAX; i++) {
+        host_link_t *l = &host_links[i];
+        cdc_buf_t *bf;
+        if (!l->active || (to && l != to))
+            continue;
+        if (!host_reserve(l, len, &bf, !to && ser_link_multi()))
+            return false; // unicast or single link, nothing sent yet
+        if (!bf)
+            continue;
 
         uint8_t *buf_dst = bf->dat + bf->len;
         *buf_dst = 0x56;
@@ -140,9 +284,76 @@ void app_bridge(void)
         memcpy(buf_dst + 3, frm->dat, 2);
         memcpy(buf_dst + 5, frm->dat + 3, *(buf_dst + 2));
         cduart_fill_crc(buf_dst);
-        bf->len += frm->dat[2] + 7;
+        bf->len += len;
+        *bytes += len;
+    }
+    return true;
+}
+
+void app_bridge(void)
+{
+    int i;
+
+    // handle data exchange
+    for (i = 0; i < SER_LINK_MAX; i++) {
+        host_link_t *l = &host_links[i];
+        if (!l->active)
+            continue;
+
+        if (!l->uart) { // usb
+            int size;
+            uint8_t *wr, *rd;
+            cdc_rx_buf_t *bf;
+            while ((bf = spsc_get(&cdc_rx_ring)) != NULL) {
+                size = bf->len + 1; // avoid scroll to begin
+                wr = bf->dat + bf->len;
+                rd = bf->dat;
+                lat_since(LAT_RX_PARSE, bf->t_rx);
+                read_from_host(l, bf->dat, size, wr, rd);
+                ser_usb_rx_free(bf);
+            }
+        } else {
+            uint32_t wd_pos = ser_uart_wr_pos(l);
+#ifdef LAT_PROF
+            if (l->lat_t_rx && wd_pos != l->rd_pos) {
+                lat_since(LAT_RX_PARSE, l->lat_t_rx);
+                l->lat_t_rx = 0;
+            }
+#endif
+            read_from_host(l, l->circ_buf, l->circ_buf_sz,
+                    l->circ_buf + wd_pos, l->circ_buf + l->rd_pos);
+            l->rd_pos = wd_pos;
+        }
+    }
+    host_to_bus();
+
+    // send to host, until the budget is used up
+    int frames = 0;
+    int bytes = 0;
+
+    while (frames < DRAIN_FRAME_BUDGET && bytes < DRAIN_BYTE_BUDGET) {
+        cd_frame_t *frm;
+
+        if (d_dev.tx_head.first) { // send d_dev.tx_head
+            frm = list_entry(d_dev.tx_head.first, cd_frame_t);
+            if (!local_to_host(frm, &bytes))
+                break;
+            list_get(&d_dev.tx_head);
+
+        } else if (r_dev.rx_head.first) { // send rs485 data
+            frm = list_entry(r_dev.rx_head.first, cd_frame_t);
+            if (!bus_to_host(frm, &bytes))
+                break;
+            lat_bus_rx_take();
+            list_get_it(&r_dev.rx_head);
+
+        } else {
+            break;
+        }
 
-        list_get_it(&r_dev.rx_head);
         list_put_it(r_dev.free_head, &frm->node);
+        frames++;
     }
+
+    drain_stat_update(frames, frames >= DRAIN_FRAME_BUDGET || bytes >= DRAIN_BYTE_BUDGET);
 }
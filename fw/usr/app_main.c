@@ -25,29 +25,24 @@ static  gpio_t led_rx = { .group = LED_RX_GPIO_Port, .num = LED_RX_Pin };
 uart_t debug_uart = { .huart = &huart4 };
 static uart_t ttl_uart = { .huart = &huart1 };
 static uart_t rs232_uart = { .huart = &huart2 };
-uart_t *hw_uart = NULL;
 
 static gpio_t r_rst_n = { .group = CDCTL_RST_N_GPIO_Port, .num = CDCTL_RST_N_Pin };
 static gpio_t r_int_n = { .group = CDCTL_INT_N_GPIO_Port, .num = CDCTL_INT_N_Pin };
 static gpio_t r_ns = { .group = CDCTL_NS_GPIO_Port, .num = CDCTL_NS_Pin };
 static spi_t r_spi = { .hspi = &hspi1, .ns_pin = &r_ns };
 
-#define CDC_RX_MAX 6
-#define CDC_TX_MAX 6
-static cdc_buf_t cdc_rx_alloc[CDC_RX_MAX];
+static cdc_rx_buf_t cdc_rx_alloc[CDC_RX_MAX];
 static cdc_buf_t cdc_tx_alloc[CDC_TX_MAX];
-list_head_t cdc_rx_free_head = {0};
+static void *cdc_rx_free_slot[CDC_RX_MAX + 1];
+spsc_t cdc_rx_free_ring = SPSC_INIT(cdc_rx_free_slot);
 list_head_t cdc_tx_free_head = {0};
-list_head_t cdc_rx_head = {0};
-list_head_t cdc_tx_head = {0};
-cdc_buf_t *cdc_rx_buf = NULL;
-cdc_buf_t *cdc_tx_buf = NULL;
+static void *cdc_rx_slot[CDC_RX_MAX + 1];
+spsc_t cdc_rx_ring = SPSC_INIT(cdc_rx_slot);
+cdc_rx_buf_t *cdc_rx_buf = NULL;
 
-#define FRAME_MAX 10
 static cd_frame_t frame_alloc[FRAME_MAX];
 list_head_t frame_free_head = {0};
 
-#define PACKET_MAX 10
 static cdnet_packet_t packet_alloc[PACKET_MAX];
 
 cdctl_dev_t r_dev = {0}; // RS485
@@ -56,15 +51,18 @@ cdnet_intf_t n_intf = {0}; // CDNET
 int usb_rx_cnt = 0;
 int usb_tx_cnt = 0;
 
-uint8_t circ_buf[CIRC_BUF_SZ];
-uint32_t rd_pos = 0;
-
 
 static void device_init(void)
 {
     int i;
+
+    // cycle counter for get_cycles()
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
     for (i = 0; i < CDC_RX_MAX; i++)
-        list_put(&cdc_rx_free_head, &cdc_rx_alloc[i].node);
+        spsc_put(&cdc_rx_free_ring, &cdc_rx_alloc[i]);
     for (i = 0; i < CDC_TX_MAX; i++)
         list_put(&cdc_tx_free_head, &cdc_tx_alloc[i].node);
     for (i = 0; i < FRAME_MAX; i++)
@@ -72,17 +70,14 @@ static void device_init(void)
     for (i = 0; i < PACKET_MAX; i++)
         list_put(&cdnet_free_pkts, &packet_alloc[i].node);
 
-    cdc_rx_buf = list_get_entry(&cdc_rx_free_head, cdc_buf_t);
+    cdc_rx_buf = spsc_get(&cdc_rx_free_ring);
 
     cdctl_dev_init(&r_dev, &frame_free_head, app_conf.rs485_mac,
             app_conf.rs485_baudrate_low, app_conf.rs485_baudrate_high,
             &r_spi, &r_rst_n, &r_int_n);
 
-    if (app_conf.ser_idx == SER_TTL) {
-        hw_uart = &ttl_uart;
-    } else if (app_conf.ser_idx == SER_RS232) {
-        hw_uart = &rs232_uart;
-    }
+    host_links[SER_TTL].uart = &ttl_uart;
+    host_links[SER_RS232].uart = &rs232_uart;
 }
 
 void set_led_state(led_state_t state)
@@ -112,28 +107,29 @@ void set_led_state(led_state_t state)
     }
 }
 
+static void led_off(sw_timer_t *t)
+{
+    gpio_set_value(t->data, 1);
+}
+
+static sw_timer_t led_rx_tm = { .fn = led_off, .data = &led_rx };
+static sw_timer_t led_tx_tm = { .fn = led_off, .data = &led_tx };
+
 static void data_led_task(void)
 {
-    static uint32_t tx_t_last = 0;
-    static uint32_t rx_t_last = 0;
     static uint32_t tx_cnt_last = 0;
     static uint32_t rx_cnt_last = 0;
 
     if (rx_cnt_last != r_dev.rx_cnt) {
         rx_cnt_last = r_dev.rx_cnt;
-        rx_t_last = get_systick();
         gpio_set_value(&led_rx, 0);
+        sw_timer_start(&led_rx_tm, 10, 0);
     }
     if (tx_cnt_last != r_dev.tx_cnt) {
         tx_cnt_last = r_dev.tx_cnt;
-        tx_t_last = get_systick();
         gpio_set_value(&led_tx, 0);
+        sw_timer_start(&led_tx_tm, 10, 0);
     }
-
-    if (gpio_get_value(&led_rx) == 0 && get_systick() - rx_t_last > 10)
-        gpio_set_value(&led_rx, 1);
-    if (gpio_get_value(&led_tx) == 0 && get_systick() - tx_t_last > 10)
-        gpio_set_value(&led_tx, 1);
 }
 
 
@@ -150,7 +146,7 @@ static void stack_check_init(void)
         *(uint32_t *)(&end + i) = 0xababcdcd;
 }
 
-static void stack_check(void)
+static void stack_check(sw_timer_t *t)
 {
     int i;
     for (i = STACK_CHECK_SKIP; i < STACK_CHECK_SIZE; i+=4) {
@@ -162,23 +158,41 @@ static void stack_check(void)
     }
 }
 
-static void dump_hw_status(void)
+#if HW_DUMP_MS
+static void dump_hw_status(sw_timer_t *t)
 {
-    static int t_l = 0;
-    if (get_systick() - t_l > 8000) {
-        USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
-        t_l = get_systick();
-        d_debug("ctl: state %d, t_len %d, r_len %d, irq %d\n",
-                r_dev.state, r_dev.tx_head.len, r_dev.rx_head.len,
-                !gpio_get_value(r_dev.int_n));
-        d_debug("  r_cnt %d (lost %d, err %d, no-free %d), t_cnt %d (cd %d, err %d)\n",
-                r_dev.rx_cnt, r_dev.rx_lost_cnt, r_dev.rx_error_cnt,
-                r_dev.rx_no_free_node_cnt,
-                r_dev.tx_cnt, r_dev.tx_cd_cnt, r_dev.tx_error_cnt);
-        d_debug("usb: r_cnt %d, t_cnt %d, t_buf %p, t_len %d, t_state %x\n",
-                usb_rx_cnt, usb_tx_cnt, cdc_tx_buf, cdc_tx_head.len, hcdc->TxState);
+    int i;
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+    d_debug("ctl: state %d, t_len %d, r_len %d, irq %d\n",
+            r_dev.state, r_dev.tx_head.len, r_dev.rx_head.len,
+            !gpio_get_value(r_dev.int_n));
+    d_debug("  r_cnt %d (lost %d, err %d, no-free %d), t_cnt %d (cd %d, err %d)\n",
+            r_dev.rx_cnt, r_dev.rx_lost_cnt, r_dev.rx_error_cnt,
+            r_dev.rx_no_free_node_cnt,
+            r_dev.tx_cnt, r_dev.tx_cd_cnt, r_dev.tx_error_cnt);
+    d_debug("usb: r_cnt %d, t_cnt %d, t_state %x\n",
+            usb_rx_cnt, usb_tx_cnt, hcdc->TxState);
+    for (i = 0; i < SER_LINK_MAX; i++) {
+        host_link_t *l = &host_links[i];
+        if (!l->active)
+            continue;
+        d_debug("link%d: t_buf %p, t_len %d, drop %d\n",
+                i, l->tx_buf, l->tx_head.len, l->tx_drop_cnt);
+        if (l->uart)
+            d_debug("  idle %d, ht %d, tc %d, ore %d, err %d, overrun %d (lost %d)\n",
+                    l->rx_stat.idle_cnt, l->rx_stat.ht_cnt, l->rx_stat.tc_cnt,
+                    l->rx_stat.ore_cnt, l->rx_stat.err_cnt,
+                    l->rx_stat.overrun_cnt, l->rx_stat.lost_cnt);
     }
+    d_debug("sched: run %d, sleep %d\n", sched_stat.run_cnt, sched_stat.sleep_cnt);
+    d_debug("flush: full %d, pkt %d, deadline %d, zlp %d\n",
+            flush_stat.full_cnt, flush_stat.pkt_cnt,
+            flush_stat.deadline_cnt, flush_stat.zlp_cnt);
+    d_debug("drain: pass %d, frame %d, max %d, budget %d, no-buf %d\n",
+            drain_stat.pass_cnt, drain_stat.frame_cnt, drain_stat.max_frames,
+            drain_stat.budget_cnt, drain_stat.no_buf_cnt);
 }
+#endif
 
 static void init_rand(void)
 {
@@ -205,6 +219,60 @@ static void jump_to_app(void)
 #endif
 
 
+#ifdef BOOTLOADER
+static void bl_timeout(sw_timer_t *t)
+{
+    if (app_conf.bl_wait != 0xff)
+        jump_to_app();
+}
+#endif
+
+static void usb_check(sw_timer_t *t)
+{
+    ser_link_routine();
+}
+
+// for anything in the data path without an event of its own
+static void data_poll(sw_timer_t *t)
+{
+    sched_post(SCHED_POLL);
+}
+
+// data path, run on any irq of the links
+static void data_task(void)
+{
+#ifdef LAT_PROF
+    uint32_t t_pass = get_cycles();
+#endif
+    ser_usb_baud_routine();
+    cdnet_intf_routine(); // handle cdnet
+    common_service_routine();
+
+    if (app_conf.mode == APP_BRIDGE)
+        app_bridge();
+    else
+        app_raw();
+
+    ser_tx_routine();
+    data_led_task();
+    stats_pool_sample();
+    debug_flush();
+#ifdef LAT_PROF
+    lat_since(LAT_LOOP, t_pass);
+#endif
+}
+
+static void timer_task(void)
+{
+    sw_timer_routine();
+    debug_flush();
+}
+
+static const sched_task_t sched_tasks[] = { // in priority order
+    { SCHED_DATA_EVTS, data_task },
+    { SCHED_TIMER, timer_task }
+};
+
 void app_main(void)
 {
 #ifdef BOOTLOADER
@@ -225,95 +293,61 @@ void app_main(void)
     else
         app_raw_init();
 
-    if (app_conf.ser_idx != SER_USB)
-        HAL_UART_Receive_DMA(hw_uart->huart, circ_buf, CIRC_BUF_SZ);
-
-#ifdef BOOTLOADER
-    uint32_t boot_time = get_systick();
+    ser_link_start();
+
+    static sw_timer_t stack_tm = { .fn = stack_check };
+    static sw_timer_t usb_tm = { .fn = usb_check };
+    static sw_timer_t poll_tm = { .fn = data_poll };
+    sw_timer_init();
+    conf_flash_check();
+    sw_timer_start(&stack_tm, 100, 100);
+#if HW_DUMP_MS
+    static sw_timer_t dump_tm = { .fn = dump_hw_status };
+    sw_timer_start(&dump_tm, HW_DUMP_MS, HW_DUMP_MS);
 #endif
-
-    while (true) {
-        data_led_task();
-        stack_check();
-        dump_hw_status();
-
+    sw_timer_start(&usb_tm, 10, 10);
+    sw_timer_start(&poll_tm, 100, 100);
 #ifdef BOOTLOADER
-        if (app_conf.bl_wait != 0xff &&
-                get_systick() - boot_time > app_conf.bl_wait * 100000 / SYSTICK_US_DIV)
-            jump_to_app();
+    static sw_timer_t bl_tm = { .fn = bl_timeout };
+    if (app_conf.bl_wait != 0xff)
+        sw_timer_start(&bl_tm, app_conf.bl_wait * 100000 / SYSTICK_US_DIV, 0);
 #endif
-        if (app_conf.ser_idx != SER_USB &&
-                hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED) {
-            d_info("usb connected\n");
-            app_conf.ser_idx = SER_USB;
-            HAL_UART_DMAStop(hw_uart->huart);
-        }
 
-        cdnet_intf_routine(); // handle cdnet
-        common_service_routine();
-
-        if (app_conf.mode == APP_BRIDGE)
-            app_bridge();
-        else
-            app_raw();
-
-        if (cdc_tx_buf) {
-            if (app_conf.ser_idx == SER_USB) {
-                USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
-                if (hcdc->TxState == 0) {
-                    list_put(&cdc_tx_free_head, &cdc_tx_buf->node);
-                    cdc_tx_buf = NULL;
-                }
-            } else { // hw_uart
-                if (hw_uart->huart->TxXferCount == 0) {
-                    hw_uart->huart->gState = HAL_UART_STATE_READY;
-                    list_put(&cdc_tx_free_head, &cdc_tx_buf->node);
-                    cdc_tx_buf = NULL;
-                    //d_verbose("hw_uart dma done.\n");
-                }
-            }
-        }
-        if (!cdc_tx_buf && cdc_tx_head.first) {
-            cdc_buf_t *bf = list_entry(cdc_tx_head.first, cdc_buf_t);
-            if (bf->len != 0) {
-                if (app_conf.ser_idx == SER_USB) {
-                    local_irq_disable();
-                    CDC_Transmit_FS(bf->dat, bf->len);
-                    local_irq_enable();
-                } else { // hw_uart
-                    //d_verbose("hw_uart dma tx...\n");
-                    HAL_UART_Transmit_DMA(hw_uart->huart, bf->dat, bf->len);
-                }
-                list_get(&cdc_tx_head);
-                cdc_tx_buf = bf;
-            }
-        }
-
-        debug_flush();
-    }
+    sched_post(SCHED_DATA_EVTS);
+    sched_run(sched_tasks, sizeof(sched_tasks) / sizeof(sched_tasks[0]));
 }
 
 
-void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+RAMFUNC void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
     if (GPIO_Pin == r_int_n.num) {
+        if (usb_baud_busy) // spi in use by ser_usb_baud_routine()
+            return;
         cdctl_int_isr(&r_dev);
+        lat_bus_isr();
+        sched_post(SCHED_RS485);
     }
 }
 
-void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+RAMFUNC void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
 {
     cdctl_spi_isr(&r_dev);
+    lat_bus_isr();
+    sched_post(SCHED_RS485);
 }
-void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+RAMFUNC void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
 {
     cdctl_spi_isr(&r_dev);
+    lat_bus_isr();
+    sched_post(SCHED_RS485);
 }
-void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+RAMFUNC void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
 {
     cdctl_spi_isr(&r_dev);
+    lat_bus_isr();
+    sched_post(SCHED_RS485);
 }
 void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
 {
-    d_error("spi error...\n");
+    t_error("spi error...\n");
 }
@@ -17,12 +17,20 @@
 #include "modbus_crc.h"
 #include "usb_device.h"
 #include "usbd_cdc_if.h"
+#include "spsc.h"
 
 typedef enum {
     APP_BRIDGE = 0,
     APP_RAW
 } app_mode_t;
 
+// when raw mode sends a partial report
+typedef enum {
+    RPT_FLUSH_TIME = 0, // rpt_idle_us after the last byte
+    RPT_FLUSH_IDLE,     // uart idle line or usb short packet, rpt_idle_us as fallback
+    RPT_FLUSH_CHARS     // rpt_chars character times at the current baudrate
+} rpt_flush_t;
+
 typedef enum {
     INTF_RS485 = 0,
     INTF_SER
@@ -34,6 +42,15 @@ typedef enum {
     SER_RS232
 } ser_idx_t;
 
+#define RPT_DST_MAX         4
+#define PRIO_RULE_MAX       4
+
+// frames to rs485 matching a rule go first, 0xff: any, both 0xff: unused
+typedef struct {
+    uint8_t         mac;    // destination mac
+    uint8_t         port;   // cdnet level 0 port
+} prio_rule_t;
+
 typedef struct {
     uint16_t        magic_code; // 0xcdcd
     uint8_t         bl_wait; // run app after timeout (unit 0.1s), 0xff: never
@@ -53,51 +70,390 @@ typedef struct {
     bool            rpt_en;
     cd_sockaddr_t   rpt_dst;
 
+    uint16_t        usb_flush_us; // hold a usb tx buffer under 64 bytes
+
+    // raw report coalescing
+    uint8_t         rpt_len;    // max data bytes per report
+    rpt_flush_t     rpt_flush;
+    uint16_t        rpt_idle_us;
+    uint8_t         rpt_chars;
+    uint8_t         rpt_dst_num; // send each report to rpt_dst and rpt_dst_ext
+    cd_sockaddr_t   rpt_dst_ext[RPT_DST_MAX - 1];
+
+    uint8_t         usb_baud_en; // usb SET_LINE_CODING sets rs485_baudrate_high
+    uint8_t         multi_host; // bridge mode: usb, ttl and rs232 at the same time
+
+    prio_rule_t     prio_rules[PRIO_RULE_MAX];
+
 } app_conf_t;
 
+#define USB_FLUSH_US_DEF    200
+#define RPT_LEN_MAX         241 // 253 - 11 (max 10 byte header, 1 byte command)
+#define RPT_IDLE_US_DEF     2000
+#define RPT_CHARS_DEF       4
+
+#define CDC_BUF_SZ          512 // CDC_DATA_HS_MAX_PACKET_SIZE
+
 typedef struct {
     list_node_t node;
     uint16_t    len;
-    uint8_t     dat[512]; // CDC_DATA_HS_MAX_PACKET_SIZE
+    uint8_t     dat[CDC_BUF_SZ];
 } cdc_buf_t;
 
+#define CDC_RX_SZ           64  // CDC_DATA_FS_OUT_PACKET_SIZE
+
+// one usb out packet
+typedef struct {
+    uint8_t     len;
+    uint8_t     dat[CDC_RX_SZ];
+#ifdef LAT_PROF
+    uint32_t    t_rx;
+#endif
+} cdc_rx_buf_t;
+
+// pool sizes, overridden by PROFILE in the Makefile
+#ifndef CDC_RX_MAX
+#define CDC_RX_MAX          16
+#endif
+#ifndef CDC_TX_MAX
+#define CDC_TX_MAX          6
+#endif
+#ifndef FRAME_MAX
+#define FRAME_MAX           16
+#endif
+#ifndef PACKET_MAX
+#define PACKET_MAX          10
+#endif
+
+// max frames and bytes moved to the host in one loop pass
+#ifndef DRAIN_FRAME_BUDGET
+#define DRAIN_FRAME_BUDGET  16
+#endif
+#ifndef DRAIN_BYTE_BUDGET
+#define DRAIN_BYTE_BUDGET   (CDC_BUF_SZ * 2)
+#endif
+
+typedef struct {
+    uint32_t    pass_cnt;   // passes which moved any frame
+    uint32_t    frame_cnt;
+    uint32_t    max_frames; // most frames moved in one pass
+    uint32_t    budget_cnt; // passes stopped by the budget
+    uint32_t    no_buf_cnt; // passes stopped by no free cdc_tx buffer
+} drain_stat_t;
+
+typedef struct {
+    uint32_t    full_cnt;   // buffer can't take another packet
+    uint32_t    pkt_cnt;    // at least one whole packet
+    uint32_t    deadline_cnt; // usb_flush_us passed
+    uint32_t    zlp_cnt;
+} flush_stat_t;
+
+typedef struct {
+    uint32_t    idle_cnt;
+    uint32_t    ht_cnt;
+    uint32_t    tc_cnt;
+    uint32_t    ore_cnt;    // uart overrun, dma not fast enough
+    uint32_t    err_cnt;    // noise, framing or parity error
+    uint32_t    overrun_cnt; // circ_buf lapped before it was read
+    uint32_t    lost_cnt;   // bytes dropped by overrun_cnt
+} ser_rx_stat_t;
+
+#define SER_LINK_MAX        3 // by ser_idx_t
+
+// a host link, all of them are active in multi host mode
+typedef struct {
+    ser_idx_t       idx;
+    uart_t          *uart;          // NULL: usb
+    bool            active;         // read and written by the data path
+    cduart_dev_t    d_dev;          // host frame parser, bridge mode
+
+    // uart rx by circular dma, the usb rx is cdc_rx_ring
+    uint8_t         *circ_buf;
+    uint32_t        circ_buf_sz;    // picked from the baudrate at ser_uart_rx_start()
+    uint32_t        rd_pos;
+    volatile uint32_t rx_lap;       // circ_buf wraps, counted by dma tc
+    uint32_t        rx_total_last;  // bytes received at the last read
+    ser_rx_stat_t   rx_stat;
+
+    // to the host
+    list_head_t     tx_head;        // cdc_buf_t
+    cdc_buf_t       *tx_buf;        // being sent
+    uint32_t        tx_tail_cyc;    // when the tail of tx_head was taken
+    bool            tx_hold;        // don't start a new transfer
+    bool            zlp_pending;    // usb: last transfer was whole packets
+    uint32_t        tx_drop_cnt;    // frames dropped for a full tx_head
+#ifdef LAT_PROF
+    uint32_t        lat_t_rx;       // last uart rx irq, 0: read already
+#endif
+} host_link_t;
+
+// tx buffers one link may hold in multi host mode
+#define LINK_TX_SHARE       max(CDC_TX_MAX / SER_LINK_MAX, 1)
+
+// scheduler events, posted by isr
+#define SCHED_USB           (1 << 0) // usb rx or tx done
+#define SCHED_SER           (1 << 1) // uart rx idle, ht, tc or tx done
+#define SCHED_RS485         (1 << 2) // cdctl rx or tx done
+#define SCHED_AGAIN         (1 << 3) // data path has more to do
+#define SCHED_POLL          (1 << 4) // slow periodic poll of the data path
+#define SCHED_TIMER         (1 << 5) // a sw_timer is due
+#define SCHED_DATA_EVTS     (SCHED_USB | SCHED_SER | SCHED_RS485 | SCHED_AGAIN | SCHED_POLL)
+
+typedef struct {
+    uint32_t    evts;       // events which wake the task
+    void        (*fn)(void);
+} sched_task_t;
+
+typedef struct {
+    uint32_t    run_cnt;
+    uint32_t    sleep_cnt;
+} sched_stat_t;
+
+typedef struct sw_timer {
+    struct sw_timer *next;
+    uint32_t        expire;     // systick
+    uint32_t        period;     // 0: one-shot
+    void            (*fn)(struct sw_timer *t);
+    void            *data;
+    bool            active;
+    uint8_t         lv;
+    uint8_t         slot;
+} sw_timer_t;
 
-#define APP_CONF_ADDR       0x0801F800 // last page
+
+#define APP_CONF_ADDR       0x0801E800 // two pages before the last, config log of config.c
+#define APP_CONF_PAGES      2
+#define APP_CONF_LEGACY     0x0801F800 // last page, plain app_conf_t read by older bootloaders
 #define RAW_SER_PORT        20
 
 
 extern USBD_HandleTypeDef hUsbDeviceFS;
-extern uart_t *hw_uart;
 
-extern list_head_t cdc_rx_free_head;
+extern spsc_t cdc_rx_free_ring;  // main -> usb isr
 extern list_head_t cdc_tx_free_head;
-extern list_head_t cdc_rx_head;
-extern list_head_t cdc_tx_head;
-extern cdc_buf_t *cdc_rx_buf;
-extern cdc_buf_t *cdc_tx_buf;
+extern spsc_t cdc_rx_ring;       // usb isr -> main
+extern cdc_rx_buf_t *cdc_rx_buf;
 
 extern list_head_t frame_free_head;
 
 extern cdctl_dev_t r_dev;   // RS485
 extern cdnet_intf_t n_intf; // CDNET
+extern volatile bool usb_baud_busy;
 
-#define CIRC_BUF_SZ 1024
-extern uint8_t circ_buf[];
-extern uint32_t rd_pos;
+// circ_buf storage per uart link is CIRC_BUF_MAX (by PROFILE), the dma uses
+// the part of it worth about CIRC_BUF_MS of line time at the baudrate
+#define CIRC_BUF_MIN        1024
+#ifndef CIRC_BUF_MAX
+#define CIRC_BUF_MAX        2048
+#endif
+#if CIRC_BUF_MAX < CIRC_BUF_MIN
+#error "CIRC_BUF_MAX below CIRC_BUF_MIN"
+#endif
+
+extern host_link_t host_links[SER_LINK_MAX];
+#define link_primary()      (&host_links[app_conf.ser_idx])
 
 extern app_conf_t app_conf;
+extern drain_stat_t drain_stat;
+extern flush_stat_t flush_stat;
+
+// priority classes of the frames from the hosts to rs485
+#define PRIO_HIGH           0
+#define PRIO_NORMAL         1
+#define PRIO_CLASS_MAX      2
+
+typedef struct {
+    uint32_t    cnt;        // frames handed to r_dev
+    uint32_t    wait_sum;   // us from the host to r_dev
+    uint32_t    wait_max;
+    uint8_t     depth;      // frames waiting now
+    uint8_t     depth_max;
+} prio_stat_t;
+
+extern prio_stat_t prio_stat[PRIO_CLASS_MAX];
+
+// run from RAM, no flash wait states on the isr and parse paths
+#ifdef HOST_BENCH
+#define RAMFUNC
+#else
+#define RAMFUNC             __attribute__((section(".ramfunc"), noinline))
+#endif
+
+// DWT cycle counter, enabled in device_init()
+#define get_cycles()        (DWT->CYCCNT)
+#define US_TO_CYCLES(us)    ((us) * (SystemCoreClock / 1000000))
+
+// latency histograms, build with LAT_PROF=1, read by port 14
+typedef enum {
+    LAT_RX_PARSE = 0,   // usb packet or uart idle irq -> host frame parser
+    LAT_BUS_QUEUE,      // rs485 class queue -> cdctl_put_tx_frame
+    LAT_BUS_TX,         // cdctl_put_tx_frame -> tx done irq
+    LAT_BUS_RX,         // rs485 rx irq -> host link queue
+    LAT_LOOP,           // one pass of the data path
+    LAT_STAGE_MAX
+} lat_stage_t;
+
+#define LAT_BUCKETS         24  // bucket n: [2^n, 2^(n+1)) cycles, the last one takes the rest
+
+typedef struct {
+    uint32_t    cnt;
+    uint32_t    max;        // cycles
+    uint32_t    bucket[LAT_BUCKETS];
+} lat_hist_t;
+
+#ifdef LAT_PROF
+extern lat_hist_t lat_hist[LAT_STAGE_MAX];
+void lat_add(lat_stage_t s, uint32_t cyc);
+void lat_bus_tx_put(void);
+void lat_bus_rx_take(void);
+void lat_bus_isr(void);
+void lat_clear(void);
+#define lat_stamp(t)        ((t) = get_cycles())
+#define lat_since(s, t)     lat_add(s, get_cycles() - (t))
+#else
+#define lat_stamp(t)        do {} while (0)
+#define lat_since(s, t)     do {} while (0)
+#define lat_bus_tx_put()    do {} while (0)
+#define lat_bus_rx_take()   do {} while (0)
+#define lat_bus_isr()       do {} while (0)
+#endif
+extern volatile uint32_t sched_pending;
+extern sched_stat_t sched_stat;
+
+// counter snapshot for port 13, all counters first
+typedef enum {
+    POOL_CDC_RX = 0,
+    POOL_CDC_TX,
+    POOL_FRAME,
+    POOL_PACKET,
+    POOL_MAX
+} pool_idx_t;
+
+typedef struct {
+    uint32_t        r_rx_cnt;
+    uint32_t        r_rx_lost_cnt;
+    uint32_t        r_rx_error_cnt;
+    uint32_t        r_rx_no_free_cnt;
+    uint32_t        r_tx_cnt;
+    uint32_t        r_tx_cd_cnt;
+    uint32_t        r_tx_error_cnt;
+    uint32_t        usb_rx_cnt;
+    uint32_t        usb_tx_cnt;
+    ser_rx_stat_t   link_rx[SER_LINK_MAX];
+    uint32_t        link_drop[SER_LINK_MAX];
+    sched_stat_t    sched;
+    flush_stat_t    flush;
+    drain_stat_t    drain;      // max_frames: since the last clear
+    uint8_t         pool_min[POOL_MAX]; // fewest free entries since the last clear
+} stats_t;
+
+#define STATS_CNT_NUM       (offsetof(stats_t, pool_min) / 4)
+
+// dump_hw_status() to the debug uart, 0: off, the counters are on port 13 anyway
+#ifndef HW_DUMP_MS
+#define HW_DUMP_MS          8000
+#endif
+
+void stats_pool_sample(void);
+void stats_read(stats_t *s, bool clear);
+
+// binary trace for the runtime, read by port 15; the d_* printf path is
+// left to boot and fatal messages
+// args: up to 4, 32 bit integers only (no %s)
+#ifndef TRACE_WORDS
+#define TRACE_WORDS         256
+#endif
+
+#define _T_NARGS(_0, _1, _2, _3, _4, n, ...) n
+#define _T_ARG(a)           (uint32_t)(uintptr_t)(a)
+#define _T_ARGS(_, a, b, c, d, ...) _T_ARG(a), _T_ARG(b), _T_ARG(c), _T_ARG(d)
+
+#define d_trace(fmt, ...) do {                                                  \
+        static const char _t_fmt[] __attribute__((section(".trace_fmt"), used)) = fmt; \
+        trace_put(_T_ARG(_t_fmt), _T_NARGS(0, ## __VA_ARGS__, 4, 3, 2, 1, 0),  \
+                _T_ARGS(0, ## __VA_ARGS__, 0, 0, 0, 0));                        \
+    } while (0)
+
+#define t_debug(fmt, ...)   d_trace("D: " fmt, ## __VA_ARGS__)
+#define t_info(fmt, ...)    d_trace("I: " fmt, ## __VA_ARGS__)
+#define t_warn(fmt, ...) do {               \
+        set_led_state(LED_WARN);            \
+        d_trace("W: " fmt, ## __VA_ARGS__); \
+    } while (0)
+
+#define t_error(fmt, ...) do {              \
+        set_led_state(LED_ERROR);           \
+        d_trace("E: " fmt, ## __VA_ARGS__); \
+    } while (0)
+
+extern uint32_t trace_lost;
+void trace_put(uint32_t id, int argc, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+int trace_read(uint32_t *dst, int max);
+
+static inline void sched_post(uint32_t evts)
+{
+    uint32_t flags;
+    local_irq_save(flags);
+    sched_pending |= evts;
+    local_irq_restore(flags);
+}
 
 void app_raw_init(void);
 void app_raw(void);
 void app_bridge_init(void);
 void app_bridge(void);
 
+cdc_buf_t *ser_tx_reserve(host_link_t *l, int len);
+void ser_usb_rx_free(cdc_rx_buf_t *bf);
+void ser_tx_routine(void);
+void ser_uart_rx_start(host_link_t *l, uint32_t baudrate);
+void ser_uart_rx_stop(host_link_t *l);
+uint32_t ser_uart_wr_pos(host_link_t *l);
+void ser_uart_isr(UART_HandleTypeDef *huart);
+bool ser_link_multi(void);
+void ser_link_start(void);
+void ser_link_routine(void);
+void ser_usb_line_coding(uint8_t cmd, uint8_t *pbuf);
+bool ser_usb_baud_pending(void);
+void ser_usb_baud_routine(void);
+void drain_stat_update(int frames, bool budget_hit);
+void sched_run(const sched_task_t *tasks, int num);
+
+void sw_timer_init(void);
+void sw_timer_start(sw_timer_t *t, uint32_t delay, uint32_t period);
+void sw_timer_stop(sw_timer_t *t);
+void sw_timer_routine(void);
+void sw_timer_isr(void);
+
 void common_service_init(void);
 void common_service_routine(void);
 
 void app_main(void);
 void load_conf_early(void);
 void load_conf(void);
-void save_conf(void);
+void save_conf(void (*cb)(uint8_t ret));
+void conf_flash_check(void);
+
+typedef enum {
+    FLASH_JOB_ERASE = 0,
+    FLASH_JOB_WRITE,
+    FLASH_JOB_CRC   // crc32 of the range
+} flash_op_t;
+
+typedef struct flash_job {
+    flash_op_t      op;
+    uint32_t        addr;
+    uint32_t        len;    // bytes, erase: rounded up to pages
+    const uint8_t   *src;   // write, kept until cb
+    uint32_t        done;
+    uint8_t         ret;    // HAL_OK or the first error
+    uint32_t        crc;
+    void            (*cb)(struct flash_job *j); // finished or failed
+    void            *data;
+} flash_job_t;
+
+bool flash_job_busy(void);
+void flash_job_start(flash_job_t *j);
+void flash_job_routine(void);
 
 #endif
@@ -18,28 +18,103 @@ void app_raw_init(void)
     cdnet_socket_bind(&sock_r, NULL);
 }
 
+static cdnet_packet_t *rpt_pkt = NULL; // report being filled
+
+// filled reports, waiting to be sent
+static list_head_t rpt_tx_head = {0};
+static cdnet_packet_t *rpt_cur; // report shared by the destinations left
+static uint8_t rpt_sent;
+
+static const cd_sockaddr_t *rpt_dst(int idx)
+{
+    return idx ? &app_conf.rpt_dst_ext[idx - 1] : &app_conf.rpt_dst;
+}
+
+// cdnet puts a sent packet back to the free list, take it back from there
+static bool rpt_reclaim(cdnet_packet_t *pkt)
+{
+    list_node_t *pre = NULL;
+    list_node_t *node = cdnet_free_pkts.first;
+
+    while (node && node != &pkt->node) {
+        pre = node;
+        node = node->next;
+    }
+    if (!node)
+        return false;
+    list_pick(&cdnet_free_pkts, pre, node);
+    return true;
+}
+
+// one packet is sent to all destinations in turn, no copy:
+// it is reclaimed after each send, and released on the last one
+static void rpt_tx_routine(void)
+{
+    int num = clip(app_conf.rpt_dst_num, 1, RPT_DST_MAX);
+
+    while (true) {
+        if (!rpt_cur) {
+            rpt_cur = list_get_entry(&rpt_tx_head, cdnet_packet_t);
+            if (!rpt_cur)
+                return;
+            rpt_sent = 0;
+        }
+
+        rpt_cur->dst = *rpt_dst(rpt_sent);
+        cdnet_socket_sendto(&sock_r, rpt_cur);
+        if (++rpt_sent >= num)
+            rpt_cur = NULL;
+        else if (!rpt_reclaim(rpt_cur)) {
+            t_warn("rpt: pkt not released, %d dst left\n", num - rpt_sent);
+            rpt_cur = NULL;
+        }
+    }
+}
+
+// no more data within the timeout, send the partial report
+static void rpt_timeout(sw_timer_t *t)
+{
+    if (rpt_pkt) {
+        list_put(&rpt_tx_head, &rpt_pkt->node);
+        rpt_pkt = NULL;
+        sched_post(SCHED_AGAIN);
+    }
+}
+
+static sw_timer_t rpt_tm = { .fn = rpt_timeout };
+
+// systick to wait for more data before sending a partial report
+static uint32_t rpt_wait(void)
+{
+    if (app_conf.rpt_flush == RPT_FLUSH_CHARS && app_conf.ser_idx != SER_USB) {
+        uint32_t baud = link_primary()->uart->huart->Init.BaudRate;
+        // 10 bits per char, rounded up
+        return (app_conf.rpt_chars * 10 * (1000000 / SYSTICK_US_DIV) + baud - 1) / baud;
+    }
+    return app_conf.rpt_idle_us / SYSTICK_US_DIV;
+}
+
+// idle: the sender paused, send what we have at once
 static void read_raw_port(const uint8_t *buf, int size,
-        const uint8_t *wr, const uint8_t *rd)
+        const uint8_t *wr, const uint8_t *rd, bool idle)
 {
-    static cdnet_packet_t *pkt = NULL;
-    static uint32_t t_last = 0;
+    static bool rpt_off_logged = false; // once per switch to off
+    static bool no_pkt_logged = false;  // once until a packet is free again
+    cdnet_packet_t *pkt = rpt_pkt;
     int max_len;
     int cpy_len;
 
     if (!app_conf.rpt_en) {
-        df_warn("rpt_en disabled\n");
-        return;
-    }
-
-    if (rd == wr && pkt && pkt->len && get_systick() - t_last > (2000 / SYSTICK_US_DIV)) {
-        cdnet_socket_sendto(&sock_r, pkt);
-        pkt = NULL;
+        if (!rpt_off_logged)
+            t_warn("read_raw_port: rpt_en disabled\n");
+        rpt_off_logged = true;
         return;
     }
+    rpt_off_logged = false;
 
     while (true) {
         if (rd == wr)
-            return;
+            break;
         else if (rd > wr)
             max_len = buf + size - rd;
         else // rd < wr
@@ -48,16 +123,18 @@ static void read_raw_port(const uint8_t *buf, int size,
         if (!pkt) {
             pkt = cdnet_packet_get(&cdnet_free_pkts);
             if (!pkt) {
-                df_error("no free pkt\n");
-                return;
+                if (!no_pkt_logged)
+                    t_error("read_raw_port: no free pkt\n");
+                no_pkt_logged = true;
+                break;
             }
-            pkt->dst = app_conf.rpt_dst;
+            no_pkt_logged = false;
             pkt->len = 1;
             pkt->dat[0] = 0; // indicate a report
         }
 
-        t_last = get_systick();
-        cpy_len = min(242 - pkt->len, max_len); // 253 - 11 (max 10 byte header, 1 byte command)
+        sw_timer_start(&rpt_tm, rpt_wait(), 0);
+        cpy_len = min(app_conf.rpt_len + 1 - pkt->len, max_len);
 
         memcpy(pkt->dat + pkt->len, rd, cpy_len);
         pkt->len += cpy_len;
@@ -65,80 +142,76 @@ static void read_raw_port(const uint8_t *buf, int size,
         if (rd == buf + size)
             rd = buf;
 
-        if (pkt->len == 242) {
-            cdnet_socket_sendto(&sock_r, pkt);
+        if (pkt->len >= app_conf.rpt_len + 1) {
+            list_put(&rpt_tx_head, &pkt->node);
             pkt = NULL;
         }
     }
+
+    if (idle && pkt && pkt->len > 1) {
+        sw_timer_stop(&rpt_tm);
+        list_put(&rpt_tx_head, &pkt->node);
+        pkt = NULL;
+    }
+    rpt_pkt = pkt;
 }
 
 
 void app_raw(void)
 {
-    // handle data exchange
-    uint32_t wd_pos = CIRC_BUF_SZ - hw_uart->huart->hdmarx->Instance->CNDTR;
+    static uint32_t idle_cnt_last = 0;
+    bool use_idle = app_conf.rpt_flush == RPT_FLUSH_IDLE;
+    host_link_t *l = link_primary(); // raw mode has a single host link
 
-    if (app_conf.ser_idx == SER_USB) {
+    // handle data exchange
+    if (!l->uart) { // usb
         int size;
         uint8_t *wr, *rd;
-        cdc_buf_t *bf = list_get_entry_it(&cdc_rx_head, cdc_buf_t);
-        if (bf) {
-            uint32_t flags;
+        cdc_rx_buf_t *bf = spsc_get(&cdc_rx_ring);
+        while (bf) {
             size = bf->len + 1; // avoid scroll to begin
             wr = bf->dat + bf->len;
             rd = bf->dat;
-            read_raw_port(bf->dat, size, wr, rd);
-
-            local_irq_save(flags);
-            list_put(&cdc_rx_free_head, &bf->node);
-            if (!cdc_rx_buf) {
-                cdc_rx_buf = list_get_entry(&cdc_rx_free_head, cdc_buf_t);
-                df_verbose("continue CDC Rx\n");
-                USBD_CDC_SetRxBuffer(&hUsbDeviceFS, cdc_rx_buf->dat);
-                USBD_CDC_ReceivePacket(&hUsbDeviceFS);
-            }
-            local_irq_restore(flags);
-        } else {
-            read_raw_port(NULL, 0, NULL, NULL); // check for timeout
+            // a short packet ends a usb transfer
+            read_raw_port(bf->dat, size, wr, rd, use_idle && bf->len < CDC_RX_SZ);
+            ser_usb_rx_free(bf);
+            bf = spsc_get(&cdc_rx_ring);
         }
-    } else { // hw_uart
-        read_raw_port(circ_buf, CIRC_BUF_SZ, circ_buf + wd_pos, circ_buf + rd_pos);
-    }
-    rd_pos = wd_pos;
-
-    cdc_buf_t *bf = NULL;
-    if (!cdc_tx_head.last) {
-        bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
-        if (!bf) {
-            df_warn("no cdc_tx_free (tx idle)\n");
-            return;
-        }
-        bf->len = 0;
-        list_put(&cdc_tx_head, &bf->node);
     } else {
-        bf = list_entry(cdc_tx_head.last, cdc_buf_t);
+        uint32_t idle_cnt = l->rx_stat.idle_cnt; // before the data it follows
+        uint32_t wd_pos = ser_uart_wr_pos(l);
+        read_raw_port(l->circ_buf, l->circ_buf_sz,
+                l->circ_buf + wd_pos, l->circ_buf + l->rd_pos, use_idle && idle_cnt != idle_cnt_last);
+        idle_cnt_last = idle_cnt;
+        l->rd_pos = wd_pos;
     }
+    rpt_tx_routine();
 
-    // write to raw port
-    cdnet_packet_t *pkt = list_entry(sock_r.rx_head.first, cdnet_packet_t);
-    if (!pkt)
-        return;
+    // write to raw port, until the budget is used up
+    int frames = 0;
+    int bytes = 0;
+
+    while (frames < DRAIN_FRAME_BUDGET && bytes < DRAIN_BYTE_BUDGET) {
+        cdnet_packet_t *pkt = list_entry(sock_r.rx_head.first, cdnet_packet_t);
+        if (!pkt)
+            break;
 
-    if (pkt->len > 1 && pkt->dat[0] == 0) {
-        if (bf->len + pkt->len - 1 > 512) {
-            bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
+        if (pkt->len > 1 && pkt->dat[0] == 0) {
+            cdc_buf_t *bf = ser_tx_reserve(l, pkt->len - 1);
             if (!bf) {
-                df_warn("no cdc_tx_free\n");
-                return;
+                drain_stat.no_buf_cnt++;
+                break;
             }
-            bf->len = 0;
-            list_put(&cdc_tx_head, &bf->node);
+
+            memcpy(bf->dat + bf->len, pkt->dat + 1, pkt->len - 1);
+            bf->len += pkt->len - 1;
+            bytes += pkt->len - 1;
         }
 
-        memcpy(bf->dat + bf->len, pkt->dat + 1, pkt->len - 1);
-        bf->len += pkt->len - 1;
+        cdnet_socket_recvfrom(&sock_r);
+        list_put(&cdnet_free_pkts, &pkt->node);
+        frames++;
     }
 
-    cdnet_socket_recvfrom(&sock_r);
-    list_put(&cdnet_free_pkts, &pkt->node);
+    drain_stat_update(frames, frames >= DRAIN_FRAME_BUDGET || bytes >= DRAIN_BYTE_BUDGET);
 }
@@ -16,6 +16,12 @@ static cdnet_socket_t sock1 = { .port = 1 };
 static cdnet_socket_t sock3 = { .port = 3 };
 static cdnet_socket_t sock10 = { .port = 10 };
 static cdnet_socket_t sock11 = { .port = 11 };
+static cdnet_socket_t sock12 = { .port = 12 };
+static cdnet_socket_t sock13 = { .port = 13 };
+#ifdef LAT_PROF
+static cdnet_socket_t sock14 = { .port = 14 };
+#endif
+static cdnet_socket_t sock15 = { .port = 15 };
 
 
 static void get_uid(char *buf)
@@ -45,6 +51,31 @@ void init_info_str(void)
 
 // make sure local mac != 255 before call any service
 
+#define P1_DEFER_MAX    4
+
+// p1 scan replies waiting for their random delay
+static sw_timer_t p1_defer[P1_DEFER_MAX];
+
+static void p1_defer_send(sw_timer_t *t)
+{
+    cdnet_socket_sendto(&sock1, t->data);
+    sched_post(SCHED_AGAIN);
+}
+
+static bool p1_defer_put(cdnet_packet_t *pkt, uint32_t delay)
+{
+    int i;
+    for (i = 0; i < P1_DEFER_MAX; i++) {
+        if (!p1_defer[i].active) {
+            p1_defer[i].fn = p1_defer_send;
+            p1_defer[i].data = pkt;
+            sw_timer_start(&p1_defer[i], delay, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
 // device info
 static void p1_service_routine(void)
 {
@@ -67,25 +98,28 @@ static void p1_service_routine(void)
             strncpy(string, (char *)pkt->dat + 5, pkt->len - 5);
         }
 
-        d_debug("dev_info: wait %d (%d), [%d, %d], str: %s\n",
-                wait_time, max_time, mac_start, mac_end, string);
+        t_debug("dev_info: wait %d (%d), [%d, %d]\n",
+                wait_time, max_time, mac_start, mac_end);
 
         cdnet_intf_t *intf = cdnet_route_search(&pkt->src.addr, NULL);
         uint8_t intf_mac = intf->mac;
 
         if (clip(intf_mac, mac_start, mac_end) == intf_mac &&
                 strstr(info_str, string) != NULL) {
-            uint32_t t_last = get_systick();
-            while (get_systick() - t_last < wait_time * 1000 / SYSTICK_US_DIV);
             pkt->dat[0] = 0x80;
             strcpy((char *)pkt->dat + 1, info_str);
             pkt->len = strlen(info_str) + 1;
             pkt->dst = pkt->src;
-            cdnet_socket_sendto(&sock1, pkt);
-            return;
+            if (!wait_time) {
+                cdnet_socket_sendto(&sock1, pkt);
+                return;
+            }
+            if (p1_defer_put(pkt, wait_time * 1000 / SYSTICK_US_DIV))
+                return;
+            t_warn("p1 ser: defer queue full\n");
         }
     }
-    d_debug("p1 ser: ignore\n");
+    t_debug("p1 ser: ignore\n");
     list_put(&cdnet_free_pkts, &pkt->node);
 }
 
@@ -106,7 +140,7 @@ static void p3_service_for_bridge(void)
 
     } else if (pkt->len == 3 && pkt->dat[0] == 0x68 && pkt->dat[1] == INTF_RS485) {
         // set mac
-        d_debug("set filter: %d...\n", pkt->dat[2]);
+        t_debug("set filter: %d...\n", pkt->dat[2]);
         cdctl_write_reg(&r_dev, REG_FILTER, pkt->dat[2]);
         pkt->len = 1;
         pkt->dat[0] = 0x80;
@@ -114,7 +148,7 @@ static void p3_service_for_bridge(void)
         cdnet_socket_sendto(&sock3, pkt);
 
     } else {
-        d_debug("p3 ser: ignore\n");
+        t_debug("p3 ser: ignore\n");
         list_put(&cdnet_free_pkts, &pkt->node);
     }
 }
@@ -130,14 +164,14 @@ static void p3_service_for_raw(void)
     if (pkt->len >= 2 && pkt->dat[0] == 0x60) { // set mac
         strncpy(string, (char *)pkt->dat + 2, pkt->len - 2);
         if (strstr(info_str, string) == NULL) {
-            d_debug("p3 ser: ignore by filter\n");
+            t_debug("p3 ser: ignore by filter\n");
             list_put(&cdnet_free_pkts, &pkt->node);
         } else {
             pkt->len = 1;
             pkt->dat[0] = 0x80;
             pkt->dst = pkt->src;
             cdnet_socket_sendto(&sock3, pkt);
-            d_debug("set filter: %d...\n", pkt->dat[1]);
+            t_debug("set filter: %d...\n", pkt->dat[1]);
             cdctl_write_reg(&r_dev, REG_FILTER, pkt->dat[1]);
             n_intf.mac = pkt->dat[1];
         }
@@ -146,7 +180,7 @@ static void p3_service_for_raw(void)
         pkt->dat[0] = 0x80;
         pkt->dst = pkt->src;
         cdnet_socket_sendto(&sock3, pkt);
-        d_debug("set net: %d...\n", n_intf.net);
+        t_debug("set net: %d...\n", n_intf.net);
         n_intf.net = pkt->dat[1];
     } else if (pkt->len == 1 && pkt->dat[0] == 0x41) { // check net id
         pkt->len = 2;
@@ -155,14 +189,32 @@ static void p3_service_for_raw(void)
         pkt->dst = pkt->src;
         cdnet_socket_sendto(&sock3, pkt);
     } else {
-        d_debug("p3 ser: ignore\n");
+        t_debug("p3 ser: ignore\n");
         list_put(&cdnet_free_pkts, &pkt->node);
     }
 }
 
 // device control
+
+static cdnet_packet_t *p10_save_pkt = NULL;
+
+// reply once the config is in flash
+static void p10_save_done(uint8_t ret)
+{
+    cdnet_packet_t *pkt = p10_save_pkt;
+
+    p10_save_pkt = NULL;
+    pkt->len = 1;
+    pkt->dat[0] = ret == HAL_OK ? 0x80 : 0x81;
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock10, pkt);
+}
+
 static void p10_service_routine(void)
 {
+    if (p10_save_pkt) // a save waits for the erase of the spare page
+        return;
+
     cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock10);
     if (!pkt)
         return;
@@ -170,59 +222,75 @@ static void p10_service_routine(void)
     if (pkt->len && (pkt->dat[0] == 0x60 || pkt->dat[0] == 0x20)) {
         NVIC_SystemReset(); // TODO: return before reset
     } else if (pkt->len && pkt->dat[0] == 0x61) {
-        d_debug("p10 ser: save config to flash\n");
-        save_conf();
-        pkt->len = 1;
-        pkt->dat[0] = 0x80;
-        pkt->dst = pkt->src;
-        cdnet_socket_sendto(&sock10, pkt);
+        t_debug("p10 ser: save config to flash\n");
+        p10_save_pkt = pkt;
+        save_conf(p10_save_done);
     } else if (pkt->len && pkt->dat[0] == 0x62) {
-        d_debug("p10 ser: stay in bootloader\n");
+        t_debug("p10 ser: stay in bootloader\n");
         app_conf.bl_wait = 0xff;
         pkt->len = 1;
         pkt->dat[0] = 0x80;
         pkt->dst = pkt->src;
         cdnet_socket_sendto(&sock10, pkt);
     } else {
-        d_debug("p10 ser: ignore\n");
+        t_debug("p10 ser: ignore\n");
         list_put(&cdnet_free_pkts, &pkt->node);
     }
 }
 
 // flash memory manipulation
+
+static flash_job_t p11_job;
+
+// reply once the erase, write or crc is done
+static void p11_job_done(flash_job_t *j)
+{
+    cdnet_packet_t *pkt = j->data;
+    uint8_t cmd = pkt->dat[0];
+
+    t_debug("nvm job %d (0: erase, 1: write, 2: crc): %08x +%d, ret: %d\n",
+            j->op, j->addr, j->len, j->ret);
+    pkt->len = 1;
+    pkt->dat[0] = j->ret == HAL_OK ? 0x80 : 0x81;
+    if (cmd == 0x62) { // keep seq
+        pkt->len = 3;
+    } else if (j->op == FLASH_JOB_CRC) {
+        memcpy(pkt->dat + 1, &j->crc, 4);
+        pkt->len = 5;
+    }
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock11, pkt);
+}
+
 static void p11_service_routine(void)
 {
     // erase: 0x6f, addr_32, len_32  | return [0x80] on success
     // read:  0x40, addr_32, len_8   | return [0x80, data]
     // write: 0x61, addr_32 + [data] | return [0x80] on success
+    // bulk write: 0x62, seq_16, addr_32 + [data] | return [0x80, seq_16] on success
+    // crc32: 0x43, addr_32, len_32  | return [0x80, crc_32]
+    // all but read run by flash_job_routine(), one command at a time;
+    // bulk writes are replied by seq, the host keeps a window of them in
+    // flight, words which are there already are skipped, so a resend is harmless
+
+    if (flash_job_busy())
+        return;
 
     cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock11);
     if (!pkt)
         return;
 
     if (pkt->dat[0] == 0x6f && pkt->len == 9) {
-        uint8_t ret;
-        uint32_t err_page = 0;
-        FLASH_EraseInitTypeDef f;
-        uint32_t addr = *(uint32_t *)(pkt->dat + 1);
-        uint32_t len = *(uint32_t *)(pkt->dat + 5);
-
-        f.TypeErase = FLASH_TYPEERASE_PAGES;
-        f.PageAddress = addr;
-        f.NbPages = (len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
-
-        ret = HAL_FLASH_Unlock();
-        if (ret == HAL_OK)
-            ret = HAL_FLASHEx_Erase(&f, &err_page);
-        ret |= HAL_FLASH_Lock();
-
-        d_debug("nvm erase: %08x +%08x, %08x, ret: %d\n",
-                addr, len, err_page, ret);
-        pkt->len = 1;
-        pkt->dat[0] = ret == HAL_OK ? 0x80 : 0x81;
+        p11_job.op = FLASH_JOB_ERASE;
+        p11_job.addr = *(uint32_t *)(pkt->dat + 1);
+        p11_job.len = *(uint32_t *)(pkt->dat + 5);
+        p11_job.cb = p11_job_done;
+        p11_job.data = pkt;
+        flash_job_start(&p11_job);
+        return;
 
     } else if (pkt->dat[0] == 0x40 && pkt->len == 6) {
-        uint32_t *src_dat = (uint32_t *) *(uint32_t *)(pkt->dat + 1);
+        uint32_t *src_dat = (uint32_t *)(uintptr_t) *(uint32_t *)(pkt->dat + 1);
         uint8_t len = pkt->dat[5];
         uint8_t cnt = (len + 3) / 4;
 
@@ -233,32 +301,42 @@ static void p11_service_routine(void)
 
         for (i = 0; i < cnt; i++)
             *(dst_dat + i) = *(src_dat + i);
-        d_debug("nvm read: %08x %d(%d)\n", src_dat, len, cnt);
+        t_debug("nvm read: %08x %d(%d)\n", src_dat, len, cnt);
         pkt->dat[0] = 0x80;
         pkt->len = min(cnt * 4, len) + 1;
 
     } else if (pkt->dat[0] == 0x61 && pkt->len > 5) {
-        uint8_t ret;
-        uint32_t *dst_dat = (uint32_t *) *(uint32_t *)(pkt->dat + 1);
-        uint8_t len = pkt->len - 5;
-        uint8_t cnt = (len + 3) / 4;
-        uint32_t *src_dat = (uint32_t *)(pkt->dat + 5);
-        uint8_t i;
+        p11_job.op = FLASH_JOB_WRITE;
+        p11_job.addr = *(uint32_t *)(pkt->dat + 1);
+        p11_job.len = pkt->len - 5;
+        p11_job.src = pkt->dat + 5;
+        p11_job.cb = p11_job_done;
+        p11_job.data = pkt;
+        flash_job_start(&p11_job);
+        return;
 
-        ret = HAL_FLASH_Unlock();
-        for (i = 0; ret == HAL_OK && i < cnt; i++)
-            ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
-                    (uint32_t)(dst_dat + i), *(src_dat + i));
-        ret |= HAL_FLASH_Lock();
+    } else if (pkt->dat[0] == 0x62 && pkt->len > 7) {
+        p11_job.op = FLASH_JOB_WRITE;
+        p11_job.addr = *(uint32_t *)(pkt->dat + 3);
+        p11_job.len = pkt->len - 7;
+        p11_job.src = pkt->dat + 7;
+        p11_job.cb = p11_job_done;
+        p11_job.data = pkt;
+        flash_job_start(&p11_job);
+        return;
 
-        d_debug("nvm write: %08x %d(%d), ret: %d\n",
-                dst_dat, pkt->len - 5, cnt, ret);
-        pkt->len = 1;
-        pkt->dat[0] = ret == HAL_OK ? 0x80 : 0x81;
+    } else if (pkt->dat[0] == 0x43 && pkt->len == 9) {
+        p11_job.op = FLASH_JOB_CRC;
+        p11_job.addr = *(uint32_t *)(pkt->dat + 1);
+        p11_job.len = *(uint32_t *)(pkt->dat + 5);
+        p11_job.cb = p11_job_done;
+        p11_job.data = pkt;
+        flash_job_start(&p11_job);
+        return;
 
     } else {
         list_put(&cdnet_free_pkts, &pkt->node);
-        d_warn("nvm: wrong cmd, len: %d\n", pkt->len);
+        t_warn("nvm: wrong cmd, len: %d\n", pkt->len);
         return;
     }
 
@@ -267,6 +345,124 @@ static void p11_service_routine(void)
     return;
 }
 
+// rs485 tx priority classes
+static void p12_service_routine(void)
+{
+    // read:  0x40 | return [0x80, prio_stat_t of each class]
+    // clear: 0x60 | return [0x80], the depth is kept
+
+    cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock12);
+    if (!pkt)
+        return;
+
+    if (pkt->len == 1 && pkt->dat[0] == 0x40) {
+        memcpy(pkt->dat + 1, prio_stat, sizeof(prio_stat));
+        pkt->len = sizeof(prio_stat) + 1;
+    } else if (pkt->len == 1 && pkt->dat[0] == 0x60) {
+        int i;
+        for (i = 0; i < PRIO_CLASS_MAX; i++) {
+            uint8_t depth = prio_stat[i].depth;
+            memset(&prio_stat[i], 0, sizeof(prio_stat_t));
+            prio_stat[i].depth = prio_stat[i].depth_max = depth;
+        }
+        pkt->len = 1;
+    } else {
+        t_debug("p12 ser: ignore\n");
+        list_put(&cdnet_free_pkts, &pkt->node);
+        return;
+    }
+
+    pkt->dat[0] = 0x80;
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock12, pkt);
+}
+// counter snapshot
+static void p13_service_routine(void)
+{
+    // read:           0x40 | return [0x80, stats_t]
+    // read and clear: 0x60 | return [0x80, stats_t]
+
+    cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock13);
+    if (!pkt)
+        return;
+
+    if (pkt->len == 1 && (pkt->dat[0] == 0x40 || pkt->dat[0] == 0x60)) {
+        stats_t s;
+        stats_read(&s, pkt->dat[0] == 0x60);
+        memcpy(pkt->dat + 1, &s, sizeof(stats_t));
+        pkt->len = sizeof(stats_t) + 1;
+    } else {
+        t_debug("p13 ser: ignore\n");
+        list_put(&cdnet_free_pkts, &pkt->node);
+        return;
+    }
+
+    pkt->dat[0] = 0x80;
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock13, pkt);
+}
+
+#ifdef LAT_PROF
+// latency histograms
+static void p14_service_routine(void)
+{
+    // info:  0x41         | return [0x80, stage num, bucket num, cycles per us]
+    // read:  0x40, stage  | return [0x80, lat_hist_t]
+    // clear: 0x60         | return [0x80]
+
+    cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock14);
+    if (!pkt)
+        return;
+
+    if (pkt->len == 1 && pkt->dat[0] == 0x41) {
+        pkt->dat[1] = LAT_STAGE_MAX;
+        pkt->dat[2] = LAT_BUCKETS;
+        pkt->dat[3] = US_TO_CYCLES(1);
+        pkt->len = 4;
+    } else if (pkt->len == 2 && pkt->dat[0] == 0x40 && pkt->dat[1] < LAT_STAGE_MAX) {
+        memcpy(pkt->dat + 1, &lat_hist[pkt->dat[1]], sizeof(lat_hist_t));
+        pkt->len = sizeof(lat_hist_t) + 1;
+    } else if (pkt->len == 1 && pkt->dat[0] == 0x60) {
+        lat_clear();
+        pkt->len = 1;
+    } else {
+        t_debug("p14 ser: ignore\n");
+        list_put(&cdnet_free_pkts, &pkt->node);
+        return;
+    }
+
+    pkt->dat[0] = 0x80;
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock14, pkt);
+}
+#endif
+
+// trace ring
+static void p15_service_routine(void)
+{
+    // read: 0x40 | return [0x80, trace_lost (4 bytes), records]
+
+    cdnet_packet_t *pkt = cdnet_socket_recvfrom(&sock15);
+    if (!pkt)
+        return;
+
+    if (pkt->len == 1 && pkt->dat[0] == 0x40) {
+        uint32_t buf[(CDNET_MAX_DAT - 5) / 4];
+        int n = trace_read(buf, sizeof(buf) / 4);
+        memcpy(pkt->dat + 1, &trace_lost, 4);
+        memcpy(pkt->dat + 5, buf, n * 4);
+        pkt->len = n * 4 + 5;
+    } else {
+        t_debug("p15 ser: ignore\n");
+        list_put(&cdnet_free_pkts, &pkt->node);
+        return;
+    }
+
+    pkt->dat[0] = 0x80;
+    pkt->dst = pkt->src;
+    cdnet_socket_sendto(&sock15, pkt);
+}
+
 
 void common_service_init(void)
 {
@@ -274,6 +470,12 @@ void common_service_init(void)
     cdnet_socket_bind(&sock3, NULL);
     cdnet_socket_bind(&sock10, NULL);
     cdnet_socket_bind(&sock11, NULL);
+    cdnet_socket_bind(&sock12, NULL);
+    cdnet_socket_bind(&sock13, NULL);
+#ifdef LAT_PROF
+    cdnet_socket_bind(&sock14, NULL);
+#endif
+    cdnet_socket_bind(&sock15, NULL);
     init_info_str();
 }
 
@@ -285,6 +487,13 @@ void common_service_routine(void)
     else
         p3_service_for_raw();
     p10_service_routine();
+    flash_job_routine();
     p11_service_routine();
+    p12_service_routine();
+    p13_service_routine();
+#ifdef LAT_PROF
+    p14_service_routine();
+#endif
+    p15_service_routine();
 }
 
@@ -11,6 +11,47 @@
 
 static  gpio_t sw = { .group = SW_MODE_GPIO_Port, .num = SW_MODE_Pin };
 
+// config log over APP_CONF_PAGES pages: a save appends one record, load
+// takes the newest
+//   record: magic, crc (of the rest), seq (32 bit), app_conf_t
+// the magic is programmed last, a record without it is skipped
+//
+// bootloaders in the field read a plain app_conf_t at APP_CONF_LEGACY, the
+// fields they know (up to rpt_dst) are kept there as a mirror of the newest
+// record; it's rewritten only when these fields change
+//
+// the erase of the page after the one in use and the mirror updates run by
+// flash_job_routine() after a save settles, one page or a few words per
+// data pass (the cpu still stalls on flash fetches during a page erase);
+// a save which moves to that page before it's erased waits for the erase
+
+#define CONF_PAGE_SZ        FLASH_PAGE_SIZE
+#define CONF_REC_MAGIC      0xcdc1
+#define CONF_REC_SZ         ((sizeof(conf_rec_t) + sizeof(app_conf_t) + 3) / 4 * 4)
+#define CONF_REC_NUM        (CONF_PAGE_SZ / CONF_REC_SZ)
+#define CONF_LEGACY_SZ      offsetof(app_conf_t, usb_flush_us)
+#define CONF_FLASH_MS       1000 // wait after a save, the next one may follow soon
+
+typedef struct {
+    uint16_t        magic;
+    uint16_t        crc;
+    uint32_t        seq;
+} conf_rec_t;
+
+static int conf_page = -1;  // page of the newest record, -1: none
+static int conf_next = 0;   // first free slot of conf_page
+static uint32_t conf_seq = 0;
+static const conf_rec_t *conf_newest = NULL;
+
+static flash_job_t conf_job;
+static bool conf_job_on = false;
+static bool conf_save_pend = false;
+static void (*conf_save_cb)(uint8_t ret) = NULL;
+static uint32_t conf_legacy_buf[(CONF_LEGACY_SZ + 3) / 4]; // src of the mirror write
+
+static void conf_flash_step(sw_timer_t *t);
+static sw_timer_t conf_tm = { .fn = conf_flash_step };
+
 
 app_conf_t app_conf = {
         .magic_code = 0xcdcd,
@@ -31,25 +72,108 @@ app_conf_t app_conf = {
         .rpt_dst = {
                 .addr.cd_addr8 = {0x80, 0x00, 0x00},
                 .port = RAW_SER_PORT
+        },
+
+        .usb_flush_us = USB_FLUSH_US_DEF,
+
+        .rpt_len = RPT_LEN_MAX,
+        .rpt_flush = RPT_FLUSH_TIME,
+        .rpt_idle_us = RPT_IDLE_US_DEF,
+        .rpt_chars = RPT_CHARS_DEF,
+        .rpt_dst_num = 1,
+
+        .usb_baud_en = false,
+        .multi_host = false,
+
+        .prio_rules = {
+                { 0xff, 0xff }, { 0xff, 0xff }, { 0xff, 0xff }, { 0xff, 0xff }
         }
 };
 
 
+static conf_rec_t *conf_slot(int page, int slot)
+{
+    return (conf_rec_t *)(APP_CONF_ADDR + page * CONF_PAGE_SZ + slot * CONF_REC_SZ);
+}
+
+static bool flash_blank(const void *addr, int len)
+{
+    const uint32_t *p = addr;
+    for (len /= 4; len; len--)
+        if (*p++ != 0xffffffff)
+            return false;
+    return true;
+}
+
+static bool rec_valid(const conf_rec_t *r)
+{
+    return r->magic == CONF_REC_MAGIC &&
+            crc16((const uint8_t *)&r->seq, CONF_REC_SZ - 4) == r->crc;
+}
+
+// find the newest record, then the first free slot after it;
+// fall back to the plain app_conf_t of older versions at the last page
+static const app_conf_t *conf_find(void)
+{
+    const conf_rec_t *newest = NULL;
+    int page, slot;
+
+    conf_page = -1;
+    conf_newest = NULL;
+    for (page = 0; page < APP_CONF_PAGES; page++) {
+        for (slot = 0; slot < CONF_REC_NUM; slot++) {
+            const conf_rec_t *r = conf_slot(page, slot);
+            if (!rec_valid(r) || (newest && (int32_t)(r->seq - conf_seq) <= 0))
+                continue;
+            newest = r;
+            conf_page = page;
+            conf_next = slot + 1;
+            conf_seq = r->seq;
+        }
+    }
+
+    if (newest) {
+        conf_newest = newest;
+        while (conf_next < CONF_REC_NUM &&
+                !flash_blank(conf_slot(conf_page, conf_next), CONF_REC_SZ))
+            conf_next++; // a save cut by power loss
+        return (const app_conf_t *)(newest + 1);
+    }
+
+    const app_conf_t *old = (const app_conf_t *)APP_CONF_LEGACY;
+    return old->magic_code == 0xcdcd ? old : NULL;
+}
+
 void load_conf_early(void)
 {
-    app_conf_t app_tmp;
-    memcpy(&app_tmp, (void *)APP_CONF_ADDR, sizeof(app_conf_t));
-    if (app_tmp.magic_code == 0xcdcd)
-        memcpy(&app_conf, &app_tmp, sizeof(app_conf_t));
+    const app_conf_t *c = conf_find();
+    if (c)
+        memcpy(&app_conf, c, sizeof(app_conf_t));
 }
 
 void load_conf(void)
 {
-    app_conf_t app_tmp;
-    memcpy(&app_tmp, (void *)APP_CONF_ADDR, sizeof(app_conf_t));
-    if (app_tmp.magic_code == 0xcdcd) {
-        d_info("conf: load from flash\n");
-        memcpy(&app_conf, &app_tmp, sizeof(app_conf_t));
+    const app_conf_t *c = conf_find();
+    if (c) {
+        d_info("conf: load from flash, seq %lu\n", conf_seq);
+        memcpy(&app_conf, c, sizeof(app_conf_t));
+        // saved by an older version: erased or zero padding
+        if (app_conf.usb_flush_us == 0xffff)
+            app_conf.usb_flush_us = USB_FLUSH_US_DEF;
+        if (!app_conf.rpt_len || app_conf.rpt_len > RPT_LEN_MAX)
+            app_conf.rpt_len = RPT_LEN_MAX;
+        if (app_conf.rpt_flush > RPT_FLUSH_CHARS)
+            app_conf.rpt_flush = RPT_FLUSH_TIME;
+        if (app_conf.rpt_idle_us == 0xffff)
+            app_conf.rpt_idle_us = RPT_IDLE_US_DEF;
+        if (!app_conf.rpt_chars || app_conf.rpt_chars == 0xff)
+            app_conf.rpt_chars = RPT_CHARS_DEF;
+        if (!app_conf.rpt_dst_num || app_conf.rpt_dst_num > RPT_DST_MAX)
+            app_conf.rpt_dst_num = 1;
+        if (app_conf.usb_baud_en == 0xff)
+            app_conf.usb_baud_en = false;
+        if (app_conf.multi_host == 0xff)
+            app_conf.multi_host = false;
     } else {
         d_info("conf: use default\n");
     }
@@ -58,36 +182,129 @@ void load_conf(void)
     d_info("conf: mode: %s\n", app_conf.mode == APP_BRIDGE ? "bridge" : "raw");
 }
 
-void save_conf(void)
+// the page the log moves to once conf_page is full
+static int conf_spare(void)
+{
+    return conf_page < 0 ? 0 : (conf_page + 1) % APP_CONF_PAGES;
+}
+
+static bool conf_move(void)
+{
+    return conf_page < 0 || conf_next >= CONF_REC_NUM;
+}
+
+static uint8_t conf_write(void)
 {
+    uint32_t buf[CONF_REC_SZ / 4] = {0};
+    conf_rec_t *r = (conf_rec_t *)buf;
+    uint16_t *src = (uint16_t *)buf;
+    uint16_t *dst;
+    int page = conf_page, slot = conf_next;
     uint8_t ret;
-    uint32_t err_page = 0;
-    FLASH_EraseInitTypeDef f;
+    int i;
 
-    f.TypeErase = FLASH_TYPEERASE_PAGES;
-    f.PageAddress = APP_CONF_ADDR;
-    f.NbPages = 1;
+    if (conf_move()) {
+        page = conf_spare();
+        slot = 0;
+    }
+
+    r->seq = conf_seq + 1;
+    memcpy(r + 1, &app_conf, sizeof(app_conf_t));
+    r->crc = crc16((uint8_t *)&r->seq, CONF_REC_SZ - 4);
+    r->magic = CONF_REC_MAGIC;
 
+    // half-words after the magic, then the magic
+    dst = (uint16_t *)conf_slot(page, slot);
     ret = HAL_FLASH_Unlock();
+    for (i = 1; ret == HAL_OK && i < CONF_REC_SZ / 2; i++)
+        ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (uint32_t)(uintptr_t)(dst + i), src[i]);
     if (ret == HAL_OK)
-        ret = HAL_FLASHEx_Erase(&f, &err_page);
+        ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (uint32_t)(uintptr_t)dst, src[0]);
+    ret |= HAL_FLASH_Lock();
 
-    if (ret != HAL_OK)
-        d_info("conf: failed to erase flash\n");
+    if (ret == HAL_OK) {
+        conf_page = page;
+        conf_next = slot + 1;
+        conf_seq = r->seq;
+        conf_newest = (const conf_rec_t *)dst;
+        t_info("conf: save to page %d slot %d, seq %d\n", page, slot, r->seq);
+    } else {
+        // a failed move stays on conf_page, the spare page is erased again
+        // before the next try; in conf_page the slot is skipped
+        if (page == conf_page)
+            conf_next = slot + 1;
+        t_error("conf: save to flash error\n");
+    }
+    return ret;
+}
 
-    uint32_t *dst_dat = (uint32_t *)APP_CONF_ADDR;
-    uint32_t *src_dat = (uint32_t *)&app_conf;
-    uint8_t cnt = (sizeof(app_conf_t) + 3) / 4;
-    uint8_t i;
+static void conf_job_done(flash_job_t *j)
+{
+    conf_job_on = false;
+    if (j->ret != HAL_OK)
+        t_error("conf: flash job %d at %08x error\n", j->op, j->addr);
+    sw_timer_start(&conf_tm, 1, 0); // next step, if any
+}
 
-    for (i = 0; ret == HAL_OK && i < cnt; i++)
-        ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
-                (uint32_t)(dst_dat + i), *(src_dat + i));
+// one flash job at a time: a pending save, erase the spare page, then bring
+// the mirror up to date (erase, write)
+static void conf_flash_step(sw_timer_t *t)
+{
+    const void *src = conf_newest ? conf_newest + 1 : NULL; // app_conf_t of the record
 
-    ret |= HAL_FLASH_Lock();
+    if (conf_job_on)
+        return;
 
-    if (ret == HAL_OK)
-        d_info("conf: save to flash successed\n");
-    else
-        d_error("conf: save to flash error\n");
+    if (conf_save_pend && (!conf_move() || flash_blank(conf_slot(conf_spare(), 0), CONF_PAGE_SZ))) {
+        uint8_t ret = conf_write();
+        conf_save_pend = false;
+        if (conf_save_cb)
+            conf_save_cb(ret);
+        conf_flash_check();
+        return;
+    }
+
+    if (flash_job_busy()) { // p11
+        sw_timer_start(&conf_tm, 100 * 1000 / SYSTICK_US_DIV, 0);
+        return;
+    }
+
+    conf_job.cb = conf_job_done;
+    if (!flash_blank(conf_slot(conf_spare(), 0), CONF_PAGE_SZ)) {
+        conf_job.op = FLASH_JOB_ERASE;
+        conf_job.addr = (uint32_t)(uintptr_t)conf_slot(conf_spare(), 0);
+        conf_job.len = CONF_PAGE_SZ;
+
+    } else if (src && memcmp((const void *)APP_CONF_LEGACY, src, CONF_LEGACY_SZ) != 0) {
+        conf_job.addr = APP_CONF_LEGACY;
+        if (!flash_blank((const void *)APP_CONF_LEGACY, CONF_PAGE_SZ)) {
+            conf_job.op = FLASH_JOB_ERASE;
+            conf_job.len = CONF_PAGE_SZ;
+        } else {
+            memcpy(conf_legacy_buf, src, CONF_LEGACY_SZ);
+            conf_job.op = FLASH_JOB_WRITE;
+            conf_job.len = sizeof(conf_legacy_buf);
+            conf_job.src = (const uint8_t *)conf_legacy_buf;
+        }
+
+    } else {
+        return;
+    }
+    conf_job_on = true;
+    flash_job_start(&conf_job);
+}
+
+// after sw_timer_init() and every save
+void conf_flash_check(void)
+{
+    sw_timer_start(&conf_tm, CONF_FLASH_MS * 1000 / SYSTICK_US_DIV, 0);
+}
+
+// cb gets the result once the record is written, at once or after the
+// erase of the spare page
+void save_conf(void (*cb)(uint8_t ret))
+{
+    conf_save_cb = cb;
+    conf_save_pend = true;
+    conf_flash_step(NULL);
 }
@@ -0,0 +1,117 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// flash erase, write and crc in steps of one page, FLASH_JOB_WORDS words or
+// FLASH_JOB_CRC_BYTES bytes per data pass, the data path runs between the steps
+// (the cpu still stalls on flash fetches during the erase of one page)
+
+#include "app_main.h"
+
+#define FLASH_JOB_WORDS     16
+#define FLASH_JOB_CRC_BYTES 1024
+
+static flash_job_t *job = NULL;
+
+
+// crc32 (ieee 802.3, as zlib), 4 bits at a time
+static uint32_t crc32_sub(const uint8_t *data, uint32_t length, uint32_t crc)
+{
+    static const uint32_t tbl[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    while (length--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ tbl[crc & 0xf];
+        crc = (crc >> 4) ^ tbl[crc & 0xf];
+    }
+    return crc;
+}
+
+bool flash_job_busy(void)
+{
+    return job != NULL;
+}
+
+void flash_job_start(flash_job_t *j)
+{
+    if (j->op == FLASH_JOB_ERASE)
+        j->len = (j->len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+    j->done = 0;
+    j->ret = HAL_OK;
+    j->crc = 0xffffffff;
+    if (!j->len) { // nothing to do, no step
+        j->crc = 0;
+        j->cb(j);
+        return;
+    }
+    job = j;
+    sched_post(SCHED_AGAIN);
+}
+
+void flash_job_routine(void)
+{
+    flash_job_t *j = job;
+    uint8_t ret;
+    int i, n;
+
+    if (!j)
+        return;
+
+    if (j->op == FLASH_JOB_CRC) {
+        n = min(FLASH_JOB_CRC_BYTES, j->len - j->done);
+        j->crc = crc32_sub((const uint8_t *)(uintptr_t)(j->addr + j->done), n, j->crc);
+        j->done += n;
+        if (j->done >= j->len) {
+            j->crc ^= 0xffffffff;
+            job = NULL;
+            j->cb(j);
+        } else {
+            sched_post(SCHED_AGAIN);
+        }
+        return;
+    }
+
+    if (j->done >= j->len) { // never a step past the end
+        job = NULL;
+        j->cb(j);
+        return;
+    }
+
+    ret = HAL_FLASH_Unlock();
+    if (j->op == FLASH_JOB_ERASE) {
+        uint32_t err_page = 0;
+        FLASH_EraseInitTypeDef f;
+        f.TypeErase = FLASH_TYPEERASE_PAGES;
+        f.PageAddress = j->addr + j->done;
+        f.NbPages = 1;
+        if (ret == HAL_OK)
+            ret = HAL_FLASHEx_Erase(&f, &err_page);
+        j->done += FLASH_PAGE_SIZE;
+    } else {
+        n = min(FLASH_JOB_WORDS, (j->len - j->done + 3) / 4);
+        for (i = 0; ret == HAL_OK && i < n; i++) {
+            uint32_t val;
+            memcpy(&val, j->src + j->done, 4);
+            // already there: a write sent again by the host
+            if (*(uint32_t *)(uintptr_t)(j->addr + j->done) != val)
+                ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, j->addr + j->done, val);
+            j->done += 4;
+        }
+    }
+    ret |= HAL_FLASH_Lock();
+
+    j->ret |= ret;
+    if (j->ret != HAL_OK || j->done >= j->len) {
+        job = NULL;
+        j->cb(j);
+    } else {
+        sched_post(SCHED_AGAIN);
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// latency histograms of the data path, build with LAT_PROF=1
+
+#include "app_main.h"
+
+#ifdef LAT_PROF
+
+lat_hist_t lat_hist[LAT_STAGE_MAX] = {0};
+
+// rs485 frames in flight, by the order of tx_cnt / rx_cnt of cdctl;
+// wr and rd run free, wr - rd is the depth
+#if FRAME_MAX & (FRAME_MAX - 1)
+#error "LAT_PROF: FRAME_MAX must be a power of 2"
+#endif
+
+typedef struct {
+    uint32_t    t[FRAME_MAX];
+    uint32_t    wr;
+    uint32_t    rd;
+    uint32_t    cnt;    // r_dev counter seen last
+} lat_ring_t;
+
+static lat_ring_t bus_tx = {0};
+static lat_ring_t bus_rx = {0};
+
+
+void lat_add(lat_stage_t s, uint32_t cyc)
+{
+    lat_hist_t *h = &lat_hist[s];
+    int b = cyc ? min(31 - __builtin_clz(cyc), LAT_BUCKETS - 1) : 0;
+    h->bucket[b]++;
+    h->cnt++;
+    h->max = max(h->max, cyc);
+}
+
+// before cdctl_put_tx_frame(); frames cdctl gave up on never count in
+// tx_cnt, drop the oldest once more than the queue and the two chip
+// buffers are waiting
+void lat_bus_tx_put(void)
+{
+    uint32_t flags;
+    local_irq_save(flags);
+    while (bus_tx.wr - bus_tx.rd > r_dev.tx_head.len + 2)
+        bus_tx.rd++;
+    bus_tx.t[bus_tx.wr++ % FRAME_MAX] = get_cycles();
+    local_irq_restore(flags);
+}
+
+// a frame of r_dev.rx_head goes to the host
+void lat_bus_rx_take(void)
+{
+    uint32_t flags;
+    local_irq_save(flags);
+    while (bus_rx.wr - bus_rx.rd > r_dev.rx_head.len)
+        bus_rx.rd++;
+    if (bus_rx.wr != bus_rx.rd)
+        lat_add(LAT_BUS_RX, get_cycles() - bus_rx.t[bus_rx.rd++ % FRAME_MAX]);
+    local_irq_restore(flags);
+}
+
+// after cdctl_int_isr()
+void lat_bus_isr(void)
+{
+    uint32_t now = get_cycles();
+
+    for (; bus_tx.cnt != r_dev.tx_cnt; bus_tx.cnt++)
+        if (bus_tx.wr != bus_tx.rd)
+            lat_add(LAT_BUS_TX, now - bus_tx.t[bus_tx.rd++ % FRAME_MAX]);
+
+    for (; bus_rx.cnt != r_dev.rx_cnt; bus_rx.cnt++) {
+        if (bus_rx.wr - bus_rx.rd == FRAME_MAX)
+            bus_rx.rd++;
+        bus_rx.t[bus_rx.wr++ % FRAME_MAX] = now;
+    }
+}
+
+void lat_clear(void)
+{
+    uint32_t flags;
+    local_irq_save(flags);
+    memset(lat_hist, 0, sizeof(lat_hist));
+    local_irq_restore(flags);
+}
+
+#endif
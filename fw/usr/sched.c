@@ -0,0 +1,43 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+#include "app_main.h"
+
+volatile uint32_t sched_pending = 0;
+sched_stat_t sched_stat = {0};
+
+
+// run the first task of tasks[] which has any event pending, then start
+// over from the first task; sleep until the next irq if none
+void sched_run(const sched_task_t *tasks, int num)
+{
+    while (true) {
+        uint32_t flags, evts = 0;
+        int i;
+
+        local_irq_save(flags);
+        for (i = 0; i < num; i++) {
+            evts = sched_pending & tasks[i].evts;
+            if (evts) {
+                sched_pending &= ~tasks[i].evts;
+                break;
+            }
+        }
+        if (!evts) {
+            sched_stat.sleep_cnt++;
+            __WFI(); // the irq which wakes us is served after restore
+        }
+        local_irq_restore(flags);
+
+        if (evts) {
+            sched_stat.run_cnt++;
+            tasks[i].fn();
+        }
+    }
+}
@@ -0,0 +1,528 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+#include "app_main.h"
+
+drain_stat_t drain_stat = {0};
+flush_stat_t flush_stat = {0};
+
+#define USB_PKT_SZ      64 // full speed bulk
+
+#define CIRC_BUF_MS     20 // line time held by circ_buf
+
+static uint8_t circ_buf[SER_LINK_MAX - 1][CIRC_BUF_MAX]; // ttl, rs232
+
+host_link_t host_links[SER_LINK_MAX] = {
+        { .idx = SER_USB },
+        { .idx = SER_TTL, .circ_buf = circ_buf[0], .circ_buf_sz = CIRC_BUF_MIN },
+        { .idx = SER_RS232, .circ_buf = circ_buf[1], .circ_buf_sz = CIRC_BUF_MIN }
+};
+
+// switch of the single host link, RS485 side is not touched
+typedef enum {
+    LINK_RUN = 0,
+    LINK_TO_USB,    // usb connected: finish the uart rx and tx first
+    LINK_TO_UART    // usb gone: finish the usb rx, resume the uart link
+} link_state_t;
+
+#define LINK_DRAIN_MS   500 // max time to send tx_head to the old link
+
+static link_state_t link_state = LINK_RUN;
+static ser_idx_t link_uart = SER_USB; // uart link to resume, SER_USB: none
+static uint32_t link_t_start;
+
+// rs485 data rates the usb host may select, with app_conf.usb_baud_en
+static const uint32_t usb_baud_list[] = {
+        115200, 230400, 250000, 460800, 500000, 921600,
+        1000000, 2000000, 2500000, 3000000, 5000000, 10000000
+};
+static uint8_t line_coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 }; // 115200 8n1
+static volatile uint32_t usb_baud_req = 0; // set by the usb isr, 0: none
+static uint32_t usb_baud_pend = 0; // accepted, waits for the rs485 side to go idle
+volatile bool usb_baud_busy = false; // cdctl registers being written, int isr held
+
+
+// all links are active at once, raw mode stays on the primary link
+bool ser_link_multi(void)
+{
+    return app_conf.multi_host && app_conf.mode == APP_BRIDGE;
+}
+
+static host_link_t *uart_link(UART_HandleTypeDef *huart)
+{
+    if (host_links[SER_TTL].uart && huart == host_links[SER_TTL].uart->huart)
+        return &host_links[SER_TTL];
+    if (host_links[SER_RS232].uart && huart == host_links[SER_RS232].uart->huart)
+        return &host_links[SER_RS232];
+    return NULL;
+}
+
+static uint32_t link_baudrate(host_link_t *l)
+{
+    return l->idx == SER_TTL ? app_conf.ttl_baudrate : app_conf.rs232_baudrate;
+}
+
+// return the tail of tx_head if it has room for len bytes,
+// otherwise append a new buffer, NULL if none is free
+cdc_buf_t *ser_tx_reserve(host_link_t *l, int len)
+{
+    cdc_buf_t *bf = NULL;
+
+    if (l->tx_head.last) {
+        bf = list_entry(l->tx_head.last, cdc_buf_t);
+        if (bf->len + len <= CDC_BUF_SZ)
+            return bf;
+    }
+
+    // a slow host may not hold the buffers of the others
+    if (ser_link_multi() && l->tx_head.len >= LINK_TX_SHARE)
+        return NULL;
+    bf = list_get_entry(&cdc_tx_free_head, cdc_buf_t);
+    if (!bf)
+        return NULL;
+    bf->len = 0;
+    list_put(&l->tx_head, &bf->node);
+    l->tx_tail_cyc = get_cycles();
+    return bf;
+}
+
+static void uart_tx_routine(host_link_t *l)
+{
+    if (l->tx_buf && l->uart->huart->TxXferCount == 0) {
+        l->uart->huart->gState = HAL_UART_STATE_READY;
+        list_put(&cdc_tx_free_head, &l->tx_buf->node);
+        l->tx_buf = NULL;
+        sched_post(SCHED_AGAIN); // for a drain stopped by no buffer
+        //d_verbose("hw_uart dma done.\n");
+    }
+    if (!l->tx_buf && l->tx_head.first && !l->tx_hold) {
+        cdc_buf_t *bf = list_entry(l->tx_head.first, cdc_buf_t);
+        if (bf->len != 0) {
+            //d_verbose("hw_uart dma tx...\n");
+            HAL_UART_Transmit_DMA(l->uart->huart, bf->dat, bf->len);
+            list_get(&l->tx_head);
+            l->tx_buf = bf;
+        }
+    }
+}
+
+// the next usb transfer starts once the previous one is done, it is written
+// to the 512 bytes tx fifo at once; a tail buffer under one packet waits for
+// more data until app_conf.usb_flush_us, and a transfer of whole packets is
+// closed by a zlp, as usbd_cdc doesn't do it
+static void usb_tx_routine(host_link_t *l)
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+    cdc_buf_t *bf;
+
+    if (!hcdc || hcdc->TxState != 0)
+        return;
+
+    if (l->tx_buf) {
+        list_put(&cdc_tx_free_head, &l->tx_buf->node);
+        l->tx_buf = NULL;
+        sched_post(SCHED_AGAIN); // for a drain stopped by no buffer
+    }
+    if (l->zlp_pending) {
+        l->zlp_pending = false;
+        flush_stat.zlp_cnt++;
+        local_irq_disable();
+        CDC_Transmit_FS(NULL, 0);
+        local_irq_enable();
+        return;
+    }
+    if (!l->tx_head.first)
+        return;
+    bf = list_entry(l->tx_head.first, cdc_buf_t);
+    if (bf->len == 0)
+        return;
+
+    if (l->tx_head.first != l->tx_head.last || bf->len > CDC_BUF_SZ - USB_PKT_SZ) {
+        flush_stat.full_cnt++;
+    } else if (bf->len >= USB_PKT_SZ) {
+        flush_stat.pkt_cnt++;
+    } else if (get_cycles() - l->tx_tail_cyc >= US_TO_CYCLES(app_conf.usb_flush_us)) {
+        flush_stat.deadline_cnt++;
+    } else {
+        sched_post(SCHED_AGAIN); // check the deadline again
+        return;
+    }
+
+    local_irq_disable();
+    CDC_Transmit_FS(bf->dat, bf->len);
+    local_irq_enable();
+    list_get(&l->tx_head);
+    l->tx_buf = bf;
+    l->zlp_pending = !(bf->len % USB_PKT_SZ);
+}
+
+// hand the tx_head of each active link to its port
+void ser_tx_routine(void)
+{
+    int i;
+    for (i = 0; i < SER_LINK_MAX; i++) {
+        host_link_t *l = &host_links[i];
+        if (!l->active)
+            continue;
+        if (l->uart)
+            uart_tx_routine(l);
+        else
+            usb_tx_routine(l);
+    }
+}
+
+// give back a usb rx buffer, restart the usb rx if it was stopped
+// for lack of free buffer
+void ser_usb_rx_free(cdc_rx_buf_t *bf)
+{
+    spsc_put(&cdc_rx_free_ring, bf);
+
+    if (!cdc_rx_buf) {
+        // the endpoint is naking, CDC_Receive_FS can't race with us here
+        uint32_t flags;
+        local_irq_save(flags);
+        cdc_rx_buf = spsc_get(&cdc_rx_free_ring);
+        d_verbose("continue CDC Rx\n");
+        USBD_CDC_SetRxBuffer(&hUsbDeviceFS, cdc_rx_buf->dat);
+        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+        local_irq_restore(flags);
+    }
+}
+
+void ser_uart_rx_start(host_link_t *l, uint32_t baudrate)
+{
+    UART_HandleTypeDef *huart = l->uart->huart;
+
+    // 10 bits per byte
+    l->circ_buf_sz = clip(baudrate / 10 * CIRC_BUF_MS / 1000, CIRC_BUF_MIN, CIRC_BUF_MAX);
+    t_debug("ser%d: baudrate %d, circ_buf_sz %d\n", l->idx, baudrate, l->circ_buf_sz);
+
+    if (huart->Init.BaudRate != baudrate) {
+        huart->Init.BaudRate = baudrate;
+        HAL_UART_Init(huart);
+    }
+
+    l->rx_lap = 0;
+    l->rx_total_last = 0;
+    l->rd_pos = 0;
+    HAL_UART_Receive_DMA(huart, l->circ_buf, l->circ_buf_sz);
+    __HAL_UART_CLEAR_IDLEFLAG(huart);
+    __HAL_UART_ENABLE_IT(huart, UART_IT_IDLE);
+}
+
+void ser_uart_rx_stop(host_link_t *l)
+{
+    DMA_HandleTypeDef *hdma = l->uart->huart->hdmarx;
+    uint32_t flags;
+
+    __HAL_UART_DISABLE_IT(l->uart->huart, UART_IT_IDLE);
+    local_irq_save(flags);
+    // the stop clears a tc not served yet, count the wrap here;
+    // cndtr is kept, so the data path can still read up to the stop
+    if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma)) &&
+            l->circ_buf_sz - hdma->Instance->CNDTR < l->circ_buf_sz / 2)
+        l->rx_lap++;
+    HAL_UART_DMAStop(l->uart->huart);
+    local_irq_restore(flags);
+}
+
+// return the dma write position of circ_buf, the bytes from rd_pos up to it
+// are new; drop them and count the loss if the dma has lapped rd_pos
+uint32_t ser_uart_wr_pos(host_link_t *l)
+{
+    DMA_HandleTypeDef *hdma = l->uart->huart->hdmarx;
+    uint32_t flags, lap, pos, total;
+
+    local_irq_save(flags);
+    lap = l->rx_lap;
+    pos = l->circ_buf_sz - hdma->Instance->CNDTR;
+    // wrapped, but the tc irq is not served yet
+    if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma)) && pos < l->circ_buf_sz / 2)
+        lap++;
+    local_irq_restore(flags);
+
+    total = lap * l->circ_buf_sz + pos;
+    if (total - l->rx_total_last >= l->circ_buf_sz) {
+        l->rx_stat.overrun_cnt++;
+        l->rx_stat.lost_cnt += total - l->rx_total_last;
+        l->rd_pos = pos;
+    }
+    l->rx_total_last = total;
+    return pos;
+}
+
+// USART1 / USART2 irq, HAL_UART_IRQHandler is not used as it aborts the
+// circular rx dma on any error
+RAMFUNC void ser_uart_isr(UART_HandleTypeDef *huart)
+{
+    host_link_t *l = uart_link(huart);
+    uint32_t sr = huart->Instance->SR;
+
+    // tc after HAL_UART_Transmit_DMA
+    if ((sr & UART_FLAG_TC) && __HAL_UART_GET_IT_SOURCE(huart, UART_IT_TC)) {
+        __HAL_UART_DISABLE_IT(huart, UART_IT_TC);
+        huart->gState = HAL_UART_STATE_READY;
+        sched_post(SCHED_SER);
+    }
+
+    if (sr & (UART_FLAG_IDLE | UART_FLAG_ORE | UART_FLAG_NE | UART_FLAG_FE | UART_FLAG_PE)) {
+        __HAL_UART_CLEAR_PEFLAG(huart); // read sr then dr, clear all of them
+        if (!l)
+            return;
+        if (sr & UART_FLAG_ORE)
+            l->rx_stat.ore_cnt++;
+        if (sr & (UART_FLAG_NE | UART_FLAG_FE | UART_FLAG_PE))
+            l->rx_stat.err_cnt++;
+        if (sr & UART_FLAG_IDLE) {
+            l->rx_stat.idle_cnt++;
+            lat_stamp(l->lat_t_rx);
+            sched_post(SCHED_SER);
+        }
+    }
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+    host_link_t *l = uart_link(huart);
+    if (l) {
+        l->rx_stat.ht_cnt++;
+        lat_stamp(l->lat_t_rx);
+        sched_post(SCHED_SER);
+    }
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+    host_link_t *l = uart_link(huart);
+    if (l) {
+        l->rx_lap++;
+        l->rx_stat.tc_cnt++;
+        lat_stamp(l->lat_t_rx);
+        sched_post(SCHED_SER);
+    }
+}
+
+
+// start the primary link, or all links in multi host mode;
+// usb is activated by ser_link_routine() once configured
+void ser_link_start(void)
+{
+    int i;
+    for (i = SER_TTL; i < SER_LINK_MAX; i++) {
+        host_link_t *l = &host_links[i];
+        if (l->idx == app_conf.ser_idx || ser_link_multi()) {
+            ser_uart_rx_start(l, link_baudrate(l));
+            l->active = true;
+        }
+    }
+    if (app_conf.ser_idx == SER_USB)
+        host_links[SER_USB].active = true;
+}
+
+static bool tx_head_empty(host_link_t *l)
+{
+    return !l->tx_head.first || list_entry(l->tx_head.first, cdc_buf_t)->len == 0;
+}
+
+static void tx_head_move(host_link_t *from, host_link_t *to)
+{
+    cdc_buf_t *bf;
+    while ((bf = list_get_entry(&from->tx_head, cdc_buf_t)) != NULL)
+        list_put(&to->tx_head, &bf->node);
+    to->tx_tail_cyc = from->tx_tail_cyc;
+}
+
+// the usb host is gone: its transfer in flight never completes
+static void usb_tx_abort(host_link_t *l)
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+    if (l->tx_buf) {
+        list_put(&cdc_tx_free_head, &l->tx_buf->node);
+        l->tx_buf = NULL;
+    }
+    if (hcdc)
+        hcdc->TxState = 0;
+    l->zlp_pending = false;
+}
+
+// follow the usb connection, call periodically
+//
+// multi host mode: the usb link is active while configured, its tx_head
+//   and rx packets are dropped when it is gone
+// single host mode, one link at a time:
+//   uart -> usb: stop the uart rx, the data path reads circ_buf up to there;
+//     send tx_head to the uart until empty or LINK_DRAIN_MS, the rest
+//     moves to usb; usb out packets wait in cdc_rx_ring meanwhile
+//   usb -> uart: the data path reads cdc_rx_ring empty, the buffer held by
+//     the unplugged usb is dropped, tx_head moves to the uart
+void ser_link_routine(void)
+{
+    host_link_t *usb = &host_links[SER_USB];
+    host_link_t *l = &host_links[link_uart];
+    bool usb_on = hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED;
+
+    if (ser_link_multi()) {
+        if (usb_on && !usb->active) {
+            t_info("link: usb connected\n");
+            usb->active = true;
+            sched_post(SCHED_USB);
+        } else if (!usb_on && usb->active) {
+            cdc_rx_buf_t *rx;
+            cdc_buf_t *tx;
+            t_info("link: usb gone, %d tx buf dropped\n", usb->tx_head.len);
+            usb->active = false;
+            usb_tx_abort(usb);
+            while ((tx = list_get_entry(&usb->tx_head, cdc_buf_t)) != NULL)
+                list_put(&cdc_tx_free_head, &tx->node);
+            while ((rx = spsc_get(&cdc_rx_ring)) != NULL)
+                ser_usb_rx_free(rx);
+        }
+        return;
+    }
+
+    switch (link_state) {
+    case LINK_RUN:
+        if (app_conf.ser_idx != SER_USB && usb_on) {
+            t_info("link: usb connected\n");
+            link_uart = app_conf.ser_idx;
+            link_t_start = get_systick();
+            ser_uart_rx_stop(&host_links[link_uart]);
+            link_state = LINK_TO_USB;
+            sched_post(SCHED_SER);
+        } else if (app_conf.ser_idx == SER_USB && !usb_on && link_uart != SER_USB) {
+            t_info("link: usb gone\n");
+            link_state = LINK_TO_UART;
+            sched_post(SCHED_USB);
+        }
+        break;
+
+    case LINK_TO_USB:
+        if (tx_head_empty(l) ||
+                get_systick() - link_t_start > LINK_DRAIN_MS * 1000 / SYSTICK_US_DIV)
+            l->tx_hold = true;
+        if (!l->tx_hold || l->tx_buf)
+            break;
+        t_info("link: switch to usb, %d tx buf moved\n", l->tx_head.len);
+        tx_head_move(l, usb);
+        l->tx_hold = false;
+        l->active = false;
+        usb->active = true;
+        app_conf.ser_idx = SER_USB;
+        link_state = LINK_RUN;
+        sched_post(SCHED_USB);
+        break;
+
+    case LINK_TO_UART:
+        if (spsc_len(&cdc_rx_ring))
+            break;
+        usb_tx_abort(usb);
+        t_info("link: switch to uart, %d tx buf moved\n", usb->tx_head.len);
+        tx_head_move(usb, l);
+        usb->active = false;
+        ser_uart_rx_start(l, link_baudrate(l));
+        l->active = true;
+        app_conf.ser_idx = link_uart;
+        link_state = LINK_RUN;
+        sched_post(SCHED_SER);
+        break;
+    }
+}
+
+// from CDC_Control_FS, in the usb isr
+void ser_usb_line_coding(uint8_t cmd, uint8_t *pbuf)
+{
+    if (cmd == CDC_SET_LINE_CODING) {
+        memcpy(line_coding, pbuf, 7);
+        if (app_conf.usb_baud_en) {
+            usb_baud_req = pbuf[0] | pbuf[1] << 8 | pbuf[2] << 16 | pbuf[3] << 24;
+            sched_post(SCHED_USB);
+        }
+
+    } else if (cmd == CDC_GET_LINE_CODING) {
+        memcpy(pbuf, line_coding, 7);
+        if (app_conf.usb_baud_en) { // the rate in use
+            uint32_t rate = app_conf.rs485_baudrate_high;
+            pbuf[0] = rate;
+            pbuf[1] = rate >> 8;
+            pbuf[2] = rate >> 16;
+            pbuf[3] = rate >> 24;
+        }
+    }
+}
+
+// the bridge holds the rs485 tx queue while a new rate waits
+bool ser_usb_baud_pending(void)
+{
+    return usb_baud_pend != 0;
+}
+
+// apply the rate requested by the usb host to the rs485 data rate once
+// the cdctl driver is idle: nothing in tx_head, no frame and no spi
+// transfer in flight; the int isr is held while the registers change,
+// so it can't start a transfer in between, the irqs stay enabled
+void ser_usb_baud_routine(void)
+{
+    uint32_t flags;
+    uint32_t rate;
+    int i;
+
+    if (usb_baud_req) {
+        local_irq_save(flags);
+        rate = usb_baud_req;
+        usb_baud_req = 0;
+        local_irq_restore(flags);
+
+        usb_baud_pend = 0;
+        if (rate != app_conf.rs485_baudrate_high) {
+            for (i = 0; i < sizeof(usb_baud_list) / sizeof(usb_baud_list[0]); i++)
+                if (rate == usb_baud_list[i])
+                    usb_baud_pend = rate;
+            if (!usb_baud_pend)
+                t_warn("usb: baudrate %d not allowed\n", rate);
+        }
+    }
+    if (!usb_baud_pend)
+        return;
+
+    // not idle: retried on the next pass, the tx done irq or data_poll
+    local_irq_save(flags);
+    if (r_dev.state != CDCTL_IDLE || r_dev.tx_head.len || r_dev.tx_frame) {
+        local_irq_restore(flags);
+        return;
+    }
+    usb_baud_busy = true;
+    local_irq_restore(flags);
+
+    cdctl_set_baud_rate(&r_dev, app_conf.rs485_baudrate_low, usb_baud_pend);
+
+    // int_n stays low until cdctl is served, catch up a held edge
+    local_irq_save(flags);
+    usb_baud_busy = false;
+    if (!gpio_get_value(r_dev.int_n))
+        cdctl_int_isr(&r_dev);
+    local_irq_restore(flags);
+    sched_post(SCHED_RS485);
+
+    t_info("usb: rs485 baudrate %d -> %d\n", app_conf.rs485_baudrate_high, usb_baud_pend);
+    app_conf.rs485_baudrate_high = usb_baud_pend;
+    usb_baud_pend = 0;
+}
+
+void drain_stat_update(int frames, bool budget_hit)
+{
+    if (!frames)
+        return;
+    drain_stat.pass_cnt++;
+    drain_stat.frame_cnt += frames;
+    drain_stat.max_frames = max(drain_stat.max_frames, frames);
+    if (budget_hit) {
+        drain_stat.budget_cnt++;
+        sched_post(SCHED_AGAIN);
+    }
+}
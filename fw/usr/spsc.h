@@ -0,0 +1,60 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+#ifndef __SPSC_H__
+#define __SPSC_H__
+
+// single producer, single consumer ring of pointers for isr <-> main,
+// without masking irq: only the producer writes wr and only the consumer
+// writes rd, both are aligned words so every access is single-copy atomic
+
+typedef struct {
+    volatile uint32_t   wr;
+    volatile uint32_t   rd;
+    uint32_t            size;   // holds size - 1 entries
+    void                **slot;
+} spsc_t;
+
+#define SPSC_INIT(_slot) { .slot = (_slot), .size = sizeof(_slot) / sizeof((_slot)[0]) }
+
+// keep the slot access on the right side of the index update
+#define spsc_barrier()  __asm__ volatile ("" ::: "memory")
+
+static inline bool spsc_put(spsc_t *q, void *p)
+{
+    uint32_t next = q->wr + 1;
+    if (next == q->size)
+        next = 0;
+    if (next == q->rd)
+        return false;
+    q->slot[q->wr] = p;
+    spsc_barrier();
+    q->wr = next;
+    return true;
+}
+
+static inline void *spsc_get(spsc_t *q)
+{
+    uint32_t rd = q->rd;
+    void *p;
+    if (rd == q->wr)
+        return NULL;
+    p = q->slot[rd];
+    spsc_barrier();
+    q->rd = (rd + 1 == q->size) ? 0 : rd + 1;
+    return p;
+}
+
+static inline uint32_t spsc_len(const spsc_t *q)
+{
+    uint32_t wr = q->wr, rd = q->rd;
+    return wr >= rd ? wr - rd : q->size - rd + wr;
+}
+
+#endif
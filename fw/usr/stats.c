@@ -0,0 +1,84 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// counter snapshot for port 13; clear only moves the base, the owners
+// of the counters never see it
+
+#include "app_main.h"
+
+extern int usb_rx_cnt;
+extern int usb_tx_cnt;
+
+static stats_t stats_base = {0};
+static uint8_t pool_min[POOL_MAX] = { 0xff, 0xff, 0xff, 0xff };
+
+
+static void pool_free(uint8_t *free)
+{
+    free[POOL_CDC_RX] = spsc_len(&cdc_rx_free_ring);
+    free[POOL_CDC_TX] = cdc_tx_free_head.len;
+    free[POOL_FRAME] = frame_free_head.len;
+    free[POOL_PACKET] = cdnet_free_pkts.len;
+}
+
+// end of each data pass, the pools are at their lowest before the frees
+// of the next pass
+void stats_pool_sample(void)
+{
+    uint8_t free[POOL_MAX];
+    int i;
+
+    pool_free(free);
+    for (i = 0; i < POOL_MAX; i++)
+        pool_min[i] = min(pool_min[i], free[i]);
+}
+
+void stats_read(stats_t *s, bool clear)
+{
+    uint32_t *cur = (uint32_t *)s;
+    uint32_t *base = (uint32_t *)&stats_base;
+    uint32_t flags, tmp, max_frames;
+    int i;
+
+    local_irq_save(flags);
+    s->r_rx_cnt = r_dev.rx_cnt;
+    s->r_rx_lost_cnt = r_dev.rx_lost_cnt;
+    s->r_rx_error_cnt = r_dev.rx_error_cnt;
+    s->r_rx_no_free_cnt = r_dev.rx_no_free_node_cnt;
+    s->r_tx_cnt = r_dev.tx_cnt;
+    s->r_tx_cd_cnt = r_dev.tx_cd_cnt;
+    s->r_tx_error_cnt = r_dev.tx_error_cnt;
+    s->usb_rx_cnt = usb_rx_cnt;
+    s->usb_tx_cnt = usb_tx_cnt;
+    for (i = 0; i < SER_LINK_MAX; i++) {
+        s->link_rx[i] = host_links[i].rx_stat;
+        s->link_drop[i] = host_links[i].tx_drop_cnt;
+    }
+    s->sched = sched_stat;
+    s->flush = flush_stat;
+    s->drain = drain_stat;
+    local_irq_restore(flags);
+
+    stats_pool_sample();
+    memcpy(s->pool_min, pool_min, POOL_MAX);
+    max_frames = s->drain.max_frames;
+
+    for (i = 0; i < STATS_CNT_NUM; i++) {
+        tmp = cur[i];
+        cur[i] -= base[i];
+        if (clear)
+            base[i] = tmp;
+    }
+    s->drain.max_frames = max_frames;
+
+    if (clear) {
+        drain_stat.max_frames = 0;
+        pool_free(pool_min);
+    }
+}
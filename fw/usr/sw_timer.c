@@ -0,0 +1,153 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+#include "app_main.h"
+
+// two level timer wheel in systick:
+//   level 0: 64 slots of 1 tick, level 1: 64 slots of 64 ticks;
+//   a timer beyond level 1 waits in its farthest slot and is placed again
+
+#define WHEEL_BITS      6
+#define WHEEL_SZ        (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SZ - 1)
+
+static sw_timer_t *wheel[2][WHEEL_SZ];
+static volatile uint32_t wheel_map[2][WHEEL_SZ / 32]; // non-empty slots, for the isr
+static uint32_t wheel_tick; // last tick processed
+
+
+static inline void map_update(int lv, int slot)
+{
+    if (wheel[lv][slot])
+        wheel_map[lv][slot >> 5] |= 1 << (slot & 31);
+    else
+        wheel_map[lv][slot >> 5] &= ~(1 << (slot & 31));
+}
+
+static void slot_add(sw_timer_t *t)
+{
+    uint32_t delta = t->expire - wheel_tick;
+
+    if ((int32_t)delta < 0) { // already late
+        t->expire = wheel_tick + 1;
+        delta = 1;
+    }
+
+    if (delta < WHEEL_SZ) {
+        t->lv = 0;
+        t->slot = t->expire & WHEEL_MASK;
+    } else if (delta < WHEEL_SZ * WHEEL_SZ) {
+        t->lv = 1;
+        t->slot = (t->expire >> WHEEL_BITS) & WHEEL_MASK;
+    } else {
+        t->lv = 1;
+        t->slot = (wheel_tick >> WHEEL_BITS) & WHEEL_MASK;
+    }
+
+    t->next = wheel[t->lv][t->slot];
+    wheel[t->lv][t->slot] = t;
+    map_update(t->lv, t->slot);
+}
+
+static void slot_del(sw_timer_t *t)
+{
+    sw_timer_t **pp = &wheel[t->lv][t->slot];
+    while (*pp) {
+        if (*pp == t) {
+            *pp = t->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    map_update(t->lv, t->slot);
+}
+
+
+void sw_timer_init(void)
+{
+    wheel_tick = get_systick();
+}
+
+// call fn after delay ticks, then every period ticks if period != 0
+void sw_timer_start(sw_timer_t *t, uint32_t delay, uint32_t period)
+{
+    if (t->active)
+        slot_del(t);
+    t->expire = get_systick() + max(delay, 1);
+    t->period = period;
+    t->active = true;
+    slot_add(t);
+
+    // the systick isr may have checked the slot already
+    if ((int32_t)(get_systick() - t->expire) >= 0)
+        sched_post(SCHED_TIMER);
+}
+
+void sw_timer_stop(sw_timer_t *t)
+{
+    if (t->active) {
+        slot_del(t);
+        t->active = false;
+    }
+}
+
+// run the callbacks up to the current tick
+void sw_timer_routine(void)
+{
+    uint32_t now = get_systick();
+
+    while (wheel_tick != now) {
+        int slot = ++wheel_tick & WHEEL_MASK;
+        sw_timer_t *t, **pp;
+
+        if (!slot) {
+            int slot1 = (wheel_tick >> WHEEL_BITS) & WHEEL_MASK;
+            t = wheel[1][slot1];
+            wheel[1][slot1] = NULL;
+            map_update(1, slot1);
+            while (t) {
+                sw_timer_t *next = t->next;
+                slot_add(t);
+                t = next;
+            }
+        }
+
+        // the callbacks may start or stop any timer, so scan from the head
+        pp = &wheel[0][slot];
+        while ((t = *pp) != NULL) {
+            if (t->expire != wheel_tick) {
+                pp = &t->next;
+                continue;
+            }
+            *pp = t->next;
+            t->active = false;
+            if (t->period) {
+                t->expire += t->period;
+                t->active = true;
+                slot_add(t);
+            }
+            map_update(0, slot);
+            t->fn(t);
+            pp = &wheel[0][slot];
+        }
+        map_update(0, slot);
+    }
+}
+
+// from SysTick_Handler: wake the scheduler only on a tick which has timers
+void sw_timer_isr(void)
+{
+    uint32_t tick = get_systick();
+    int slot = tick & WHEEL_MASK;
+    int slot1 = (tick >> WHEEL_BITS) & WHEEL_MASK;
+
+    if ((wheel_map[0][slot >> 5] & (1 << (slot & 31))) ||
+            (!slot && (wheel_map[1][slot1 >> 5] & (1 << (slot1 & 31)))))
+        sched_post(SCHED_TIMER);
+}
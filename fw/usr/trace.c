@@ -0,0 +1,61 @@
+/*
+ * Software License Agreement (MIT License)
+ *
+ * Copyright (c) 2017, DUKELEC, Inc.
+ * All rights reserved.
+ *
+ * Author: Duke Fong <duke@dukelec.com>
+ */
+
+// binary trace ring, the formats stay in the .trace_fmt section of the elf
+// and are rebuilt by sw/trace_dump.py
+//
+// record: [0xcd, argc, id (2 bytes)], cycles, arg0 ... arg(argc-1), 32 bit each
+
+#include "app_main.h"
+
+static uint32_t trace_buf[TRACE_WORDS];
+static uint32_t trace_wr = 0; // free running word index
+static uint32_t trace_rd = 0;
+uint32_t trace_lost = 0;
+
+
+RAMFUNC void trace_put(uint32_t id, int argc, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+    uint32_t flags, w;
+
+    local_irq_save(flags);
+    w = trace_wr;
+    if (w - trace_rd + 2 + argc > TRACE_WORDS) {
+        trace_lost++;
+        local_irq_restore(flags);
+        return;
+    }
+    trace_buf[w++ % TRACE_WORDS] = 0xcd000000 | argc << 16 | (id & 0xffff);
+    trace_buf[w++ % TRACE_WORDS] = get_cycles();
+    if (argc > 0)
+        trace_buf[w++ % TRACE_WORDS] = a0;
+    if (argc > 1)
+        trace_buf[w++ % TRACE_WORDS] = a1;
+    if (argc > 2)
+        trace_buf[w++ % TRACE_WORDS] = a2;
+    if (argc > 3)
+        trace_buf[w++ % TRACE_WORDS] = a3;
+    trace_wr = w;
+    local_irq_restore(flags);
+}
+
+// move whole records, at most max words, return the words moved
+int trace_read(uint32_t *dst, int max)
+{
+    int n = 0;
+
+    while (trace_rd != trace_wr) {
+        int len = ((trace_buf[trace_rd % TRACE_WORDS] >> 16) & 0xff) + 2;
+        if (n + len > max)
+            break;
+        while (len--)
+            dst[n++] = trace_buf[trace_rd++ % TRACE_WORDS];
+    }
+    return n;
+}
@@ -15,6 +15,10 @@ convert config format between cfg and binary:
 use default config:
   ./config_conv.py --to-cfg --cfg xxx.cfg
   ./config_conv.py --to-bin --bin xxx.bin
+
+--log: the binary is the config log of the device (0x0801e800, two pages),
+the newest record is read, or a log with one record is written; a dump
+which also holds the last page (6 KB) falls back to its plain config
 """
 
 import copy
@@ -50,7 +54,26 @@ def_conf = {
     "rpt_dst": {
         "addr": "800000",           # bcd, 3 bytes
         "port": 20                  # uint16_t
-    }
+    },
+    "usb_flush_us": 200,            # uint16_t
+    "rpt_len": 241,                 # uint8_t, max data bytes per report
+    "rpt_flush": 0,                 # enum (uint8_t), 0: time, 1: idle line, 2: chars
+    "rpt_idle_us": 2000,            # uint16_t
+    "rpt_chars": 4,                 # uint8_t
+    "rpt_dst_num": 1,               # uint8_t, use rpt_dst and the first n-1 of rpt_dst_ext
+    "rpt_dst_ext": [
+        {"addr": "800000", "port": 20}, # bcd 3 bytes (pad 1 byte), uint16_t (pad 2 bytes)
+        {"addr": "800000", "port": 20},
+        {"addr": "800000", "port": 20}
+    ],
+    "usb_baud_en": 0,               # uint8_t, usb host baudrate sets rs485_baudrate_high
+    "multi_host": 0,                # uint8_t, bridge mode: usb, ttl and rs232 at once
+    "prio_rules": [                 # frames to rs485 matching a rule go first
+        {"mac": 0xff, "port": 0xff}, # uint8_t, uint8_t; 0xff: any, both 0xff: unused
+        {"mac": 0xff, "port": 0xff},
+        {"mac": 0xff, "port": 0xff},
+        {"mac": 0xff, "port": 0xff}
+    ]                               # (pad 2 bytes)
 }
 
 
@@ -68,6 +91,32 @@ def conf_from_bytes(b):
     c['rpt_en'] = struct.unpack("<B", b[24:25])[0]
     c['rpt_dst']['addr'] = b[28:31].hex()
     c['rpt_dst']['port'] = struct.unpack("<H", b[32:34])[0]
+    if len(b) >= 38 and b[36:38] != b'\xff\xff': # 0xffff: older version
+        c['usb_flush_us'] = struct.unpack("<H", b[36:38])[0]
+    if len(b) >= 44: # erased or zero: older version, same as load_conf()
+        if b[38] != 0 and b[38] <= 241:
+            c['rpt_len'] = b[38]
+        if b[39] <= 2:
+            c['rpt_flush'] = b[39]
+        if b[40:42] != b'\xff\xff':
+            c['rpt_idle_us'] = struct.unpack("<H", b[40:42])[0]
+        if b[42] != 0 and b[42] != 0xff:
+            c['rpt_chars'] = b[42]
+        if b[43] != 0 and b[43] <= 4:
+            c['rpt_dst_num'] = b[43]
+    if len(b) >= 68:
+        for i in range(3):
+            o = 44 + i * 8
+            c['rpt_dst_ext'][i]['addr'] = b[o:o+3].hex()
+            c['rpt_dst_ext'][i]['port'] = struct.unpack("<H", b[o+4:o+6])[0]
+    if len(b) >= 72 and b[68] != 0xff:
+        c['usb_baud_en'] = b[68]
+    if len(b) >= 72 and b[69] != 0xff:
+        c['multi_host'] = b[69]
+    if len(b) >= 80:
+        for i in range(4):
+            c['prio_rules'][i]['mac'] = b[70 + i * 2]
+            c['prio_rules'][i]['port'] = b[71 + i * 2]
     return c
 
 def conf_to_bytes(c):
@@ -88,23 +137,81 @@ def conf_to_bytes(c):
     b += bytes.fromhex(c['rpt_dst']['addr']) + b'\x00'
     b += struct.pack("<H", c['rpt_dst']['port'])
     b += b'\x00' * 2
+    b += struct.pack("<H", c['usb_flush_us'])
+    b += struct.pack("<B", c['rpt_len'])
+    b += struct.pack("<B", c['rpt_flush'])
+    b += struct.pack("<H", c['rpt_idle_us'])
+    b += struct.pack("<B", c['rpt_chars'])
+    b += struct.pack("<B", c['rpt_dst_num'])
+    for d in c['rpt_dst_ext']:
+        b += bytes.fromhex(d['addr']) + b'\x00'
+        b += struct.pack("<H", d['port'])
+        b += b'\x00' * 2
+    b += struct.pack("<B", c['usb_baud_en'])
+    b += struct.pack("<B", c['multi_host'])
+    for r in c['prio_rules']:
+        b += struct.pack("<BB", r['mac'], r['port'])
+    b += b'\x00' * 2
     
-    assert len(b) == 36
+    assert len(b) == 80
     return b
 
 
+# config log of fw/usr/config.c, the plain config of older versions is in
+# the page after it:
+#   record: magic (2 bytes), crc (2 bytes), seq (4 bytes), app_conf_t
+LOG_PAGE_SZ = 0x800
+LOG_PAGES = 2
+LOG_REC_MAGIC = 0xcdc1
+
+def crc16(dat):
+    crc = 0xffff
+    for b in dat:
+        crc ^= b
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0xa001 if crc & 1 else crc >> 1
+    return crc
+
+def log_rec_sz():
+    return (8 + len(conf_to_bytes(def_conf)) + 3) // 4 * 4
+
+def conf_from_log(b):
+    sz = log_rec_sz()
+    newest = None
+    for page in range(LOG_PAGES):
+        for ofs in range(page * LOG_PAGE_SZ, (page + 1) * LOG_PAGE_SZ - sz + 1, sz):
+            magic, crc, seq = struct.unpack("<HHI", b[ofs:ofs+8])
+            if magic != LOG_REC_MAGIC or crc16(b[ofs+4:ofs+sz]) != crc:
+                continue
+            if newest is None or ((seq - newest[0]) & 0xffffffff) < 0x80000000:
+                newest = (seq, b[ofs+8:ofs+sz])
+    if newest is None: # plain config of older versions at the last page
+        print('no log record, read the last page')
+        return conf_from_bytes(b[LOG_PAGES * LOG_PAGE_SZ:])
+    print('log record seq', newest[0])
+    return conf_from_bytes(newest[1])
+
+def conf_to_log(c):
+    rec = struct.pack("<I", 1) + conf_to_bytes(c)
+    rec += b'\x00' * (log_rec_sz() - 4 - len(rec))
+    rec = struct.pack("<HH", LOG_REC_MAGIC, crc16(rec)) + rec
+    return rec + b'\xff' * (LOG_PAGE_SZ * LOG_PAGES - len(rec))
+
+
 if __name__ == "__main__":
     parser = ArgumentParser(usage=__doc__)
     parser.add_argument('--to-cfg', action='store_true')
     parser.add_argument('--to-bin', action='store_true')
     parser.add_argument('--cfg', dest='cfg')
     parser.add_argument('--bin', dest='bin')
+    parser.add_argument('--log', action='store_true')
     args = parser.parse_args()
 
     if args.to_cfg:
         if args.bin:
             with open(args.bin, 'rb') as f:
-                conf = conf_from_bytes(f.read())
+                b = f.read()
+                conf = conf_from_log(b) if args.log else conf_from_bytes(b)
         else:
             print('use default conf')
             conf = def_conf
@@ -128,7 +235,7 @@ if __name__ == "__main__":
             print('save to binary', args.bin)
             print()
             pp.pprint(conf)
-            f.write(conf_to_bytes(conf))
+            f.write(conf_to_log(conf) if args.log else conf_to_bytes(conf))
 
     else:
         print(__doc__)
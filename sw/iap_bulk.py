@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# Software License Agreement (BSD License)
+#
+# Copyright (c) 2018, DUKELEC, Inc.
+# All rights reserved.
+#
+# Author: Duke Fong <duke@dukelec.com>
+
+"""CDBUS Bridge bulk flash upload
+
+erase, write with a window of bulk writes (port 11, 0x62) in flight,
+then check the crc32 computed by the device (0x43):
+  ./iap_bulk.py --dev /dev/ttyACM0 --addr 00:00:55 --flash 0x08010000 --in-file cdbus_bridge.bin
+
+only check the crc32 of a range:
+  ./iap_bulk.py --dev /dev/ttyACM0 --flash 0x08010000 --in-file cdbus_bridge.bin --check
+"""
+
+import os
+import sys
+import time
+import zlib
+import struct
+from argparse import ArgumentParser
+
+CHUNK = 240 # data of one bulk write, the packet has 7 bytes more
+
+
+def open_sock(args):
+    # cdnet python package of the cdbus_tools submodule
+    sys.path.append(os.path.join(os.path.dirname(__file__), 'cdbus_tools', 'pycdnet'))
+    from cdnet.dev.cdbus_serial import CDBusSerial
+    from cdnet.dispatch import CDNetIntf, CDNetSocket
+    dev = CDBusSerial(args.dev, baud=args.baud)
+    CDNetIntf(dev, mac=0x00)
+    return CDNetSocket(('', 0xcdcd))
+
+
+def cmd(sock, args, dat, timeout):
+    # stop-and-wait, drop the late replies of bulk writes
+    sock.sendto(dat, (args.addr, 11))
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        ret, src = sock.recvfrom(timeout=end - time.monotonic())
+        if ret and len(ret) != 3:
+            return ret
+    return None
+
+
+def bulk_write(sock, args, base, img):
+    chunks = [(base + i, img[i:i + CHUNK]) for i in range(0, len(img), CHUNK)]
+    sent = {} # seq: time sent
+    done = set()
+    nxt = 0
+    retry = 0
+
+    while len(done) < len(chunks):
+        # keep the window full, the oldest pending goes first
+        while len(sent) < args.window and nxt < len(chunks):
+            if nxt not in done:
+                addr, dat = chunks[nxt]
+                sock.sendto(struct.pack('<BHI', 0x62, nxt & 0xffff, addr) + dat, (args.addr, 11))
+                sent[nxt] = time.monotonic()
+            nxt += 1
+
+        ret, src = sock.recvfrom(timeout=args.timeout)
+        if ret and len(ret) == 3:
+            seq, = struct.unpack('<H', ret[1:3])
+            # seq is 16 bit, map it back to the pending one
+            seq = next((s for s in sent if s & 0xffff == seq), None)
+            if seq is None:
+                continue
+            del sent[seq]
+            if ret[0] != 0x80:
+                sys.exit(f'write error at {chunks[seq][0]:08x}')
+            done.add(seq)
+            retry = 0
+            continue
+
+        # timeout: send the pending ones again, from the oldest
+        retry += 1
+        if retry > args.retry:
+            sys.exit(f'no reply, {len(done)} / {len(chunks)} written')
+        resend = sorted(sent)
+        sent.clear()
+        nxt = min(resend) if resend else nxt
+        print(f'timeout, send again from {chunks[nxt][0]:08x}')
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(usage=__doc__)
+    parser.add_argument('--dev', dest='dev', default='ttyACM0')
+    parser.add_argument('--baud', dest='baud', type=int, default=115200)
+    parser.add_argument('--addr', dest='addr', default='00:00:55')
+    parser.add_argument('--flash', dest='flash', default='0x08010000')
+    parser.add_argument('--in-file', dest='in_file', required=True)
+    parser.add_argument('--window', dest='window', type=int, default=4) # fit in the packet pool of the device
+    parser.add_argument('--timeout', dest='timeout', type=float, default=0.5)
+    parser.add_argument('--retry', dest='retry', type=int, default=5)
+    parser.add_argument('--check', dest='check', action='store_true')
+    args = parser.parse_args()
+
+    base = int(args.flash, 0)
+    with open(args.in_file, 'rb') as f:
+        img = f.read()
+    img += b'\xff' * (-len(img) % 4)
+
+    sock = open_sock(args)
+    t = time.monotonic()
+
+    if not args.check:
+        ret = cmd(sock, args, struct.pack('<BII', 0x6f, base, len(img)), 5)
+        if not ret or ret[0] != 0x80:
+            sys.exit('erase error')
+        print(f'erase: {time.monotonic() - t:.2f} s')
+        bulk_write(sock, args, base, img)
+        print(f'write: {time.monotonic() - t:.2f} s, {len(img)} bytes')
+
+    ret = cmd(sock, args, struct.pack('<BII', 0x43, base, len(img)), 5)
+    if not ret or ret[0] != 0x80 or len(ret) != 5:
+        sys.exit('crc error')
+    crc, = struct.unpack('<I', ret[1:5])
+    if crc != zlib.crc32(img):
+        sys.exit(f'crc mismatch: device {crc:08x}, file {zlib.crc32(img):08x}')
+    print(f'crc ok: {crc:08x}, {time.monotonic() - t:.2f} s')
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# Software License Agreement (BSD License)
+#
+# Copyright (c) 2018, DUKELEC, Inc.
+# All rights reserved.
+#
+# Author: Duke Fong <duke@dukelec.com>
+
+"""CDBUS Bridge latency report
+
+clear the histograms of port 14 (firmware built with LAT_PROF=1), run the
+traffic for some seconds, then print the cycles of each stage:
+  ./lat_report.py --dev /dev/ttyACM0 --time 10 --save after.bin
+
+compare with a saved run, e.g. of the build before a change:
+  ./lat_report.py --bin after.bin --base before.bin
+"""
+
+import os
+import sys
+import time
+import struct
+from argparse import ArgumentParser
+
+# same order as lat_stage_t of fw/usr/app_main.h
+STAGES = ['rx_parse', 'bus_queue', 'bus_tx', 'bus_rx', 'loop']
+BUCKETS = 24
+
+
+def decode(dat):
+    # saved run: [stage num, cycles per us] + lat_hist_t of each stage
+    num, mhz = dat[0], dat[1]
+    size = 4 * (2 + BUCKETS)
+    hists = []
+    for i in range(num):
+        v = struct.unpack_from(f'<{2 + BUCKETS}I', dat, 2 + i * size)
+        hists.append({'cnt': v[0], 'max': v[1], 'bucket': v[2:]})
+    return hists, mhz
+
+
+def pct(h, p):
+    # upper bound of the bucket holding the p quantile, in cycles
+    need = h['cnt'] * p
+    acc = 0
+    for n, c in enumerate(h['bucket']):
+        acc += c
+        if c and acc >= need:
+            return min(2 << n, h['max'])
+    return h['max']
+
+
+def row(h, mhz):
+    if not h['cnt']:
+        return None
+    return [pct(h, 0.5) / mhz, pct(h, 0.99) / mhz, h['max'] / mhz]
+
+
+def show(hists, mhz, base=None):
+    print(f'{"stage":10} {"cnt":>9} {"p50 us":>9} {"p99 us":>9} {"max us":>9}')
+    for i, h in enumerate(hists):
+        r = row(h, mhz)
+        if not r:
+            continue
+        line = f'{STAGES[i]:10} {h["cnt"]:9} ' + ' '.join(f'{v:9.2f}' for v in r)
+        b = row(base[i], mhz) if base else None
+        if b: # before -> after, in percent
+            line += '   ' + ' '.join(f'{(v - w) * 100 / w:+6.0f}%' if w else '    n/a' for v, w in zip(r, b))
+        print(line)
+
+
+def open_sock(args):
+    # cdnet python package of the cdbus_tools submodule
+    sys.path.append(os.path.join(os.path.dirname(__file__), 'cdbus_tools', 'pycdnet'))
+    from cdnet.dev.cdbus_serial import CDBusSerial
+    from cdnet.dispatch import CDNetIntf, CDNetSocket
+    dev = CDBusSerial(args.dev, baud=args.baud)
+    CDNetIntf(dev, mac=0x00)
+    return CDNetSocket(('', 0xcdcd))
+
+
+def cmd(sock, args, dat):
+    sock.sendto(dat, (args.addr, 14))
+    ret, src = sock.recvfrom(timeout=1)
+    if not ret or ret[0] != 0x80:
+        sys.exit('no reply, LAT_PROF=1 build?')
+    return ret[1:]
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(usage=__doc__)
+    parser.add_argument('--dev', dest='dev', default='ttyACM0')
+    parser.add_argument('--baud', dest='baud', type=int, default=115200)
+    parser.add_argument('--addr', dest='addr', default='00:00:55')
+    parser.add_argument('--time', dest='time', type=float, default=10)
+    parser.add_argument('--save', dest='save')
+    parser.add_argument('--bin', dest='bin')
+    parser.add_argument('--base', dest='base')
+    args = parser.parse_args()
+
+    base = None
+    if args.base:
+        with open(args.base, 'rb') as f:
+            base, mhz = decode(f.read())
+
+    if args.bin:
+        with open(args.bin, 'rb') as f:
+            dat = f.read()
+    else:
+        sock = open_sock(args)
+        num, buckets, mhz = cmd(sock, args, b'\x41')[:3]
+        if buckets != BUCKETS:
+            sys.exit(f'{buckets} buckets, expect {BUCKETS}')
+        cmd(sock, args, b'\x60')
+        print(f'clear, wait {args.time} s')
+        time.sleep(args.time)
+        dat = bytes([num, mhz]) + b''.join(cmd(sock, args, bytes([0x40, i])) for i in range(num))
+        if args.save:
+            with open(args.save, 'wb') as f:
+                f.write(dat)
+
+    hists, mhz = decode(dat)
+    show(hists, mhz, base)
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Software License Agreement (BSD License)
+#
+# Copyright (c) 2018, DUKELEC, Inc.
+# All rights reserved.
+#
+# Author: Duke Fong <duke@dukelec.com>
+
+"""CDBUS Bridge counter monitor
+
+poll the counters of port 13 (read and clear), print one line per poll:
+  ./stats_mon.py --dev /dev/ttyACM0 --interval 0.1
+
+decode a saved reply (without the leading 0x80):
+  ./stats_mon.py --bin stats.bin
+"""
+
+import os
+import sys
+import time
+import struct
+from argparse import ArgumentParser
+
+# same order as stats_t of fw/usr/app_main.h
+LINKS = ['usb', 'ttl', 'rs232']
+LINK_RX = ['idle', 'ht', 'tc', 'ore', 'err', 'overrun', 'lost']
+POOLS = ['cdc_rx', 'cdc_tx', 'frame', 'packet']
+
+FIELDS = ['r_rx', 'r_rx_lost', 'r_rx_error', 'r_rx_no_free',
+          'r_tx', 'r_tx_cd', 'r_tx_error', 'usb_rx', 'usb_tx']
+for l in LINKS:
+    FIELDS += [f'{l}_{n}' for n in LINK_RX]
+FIELDS += [f'{l}_drop' for l in LINKS]
+FIELDS += ['sched_run', 'sched_sleep']
+FIELDS += ['flush_full', 'flush_pkt', 'flush_deadline', 'flush_zlp']
+FIELDS += ['drain_pass', 'drain_frame', 'drain_max', 'drain_budget', 'drain_no_buf']
+
+STATS_FMT = f'<{len(FIELDS)}I{len(POOLS)}B'
+
+
+def decode(dat):
+    v = struct.unpack(STATS_FMT, dat[:struct.calcsize(STATS_FMT)])
+    s = dict(zip(FIELDS, v))
+    s.update({f'{p}_min': n for p, n in zip(POOLS, v[len(FIELDS):])})
+    return s
+
+
+def show(s, sec=None):
+    # counters which moved, per second if the interval is known
+    out = []
+    for k, v in s.items():
+        if not v and not k.endswith('_min'):
+            continue
+        if sec and not k.endswith('_min') and k != 'drain_max':
+            out.append(f'{k} {v / sec:.0f}/s')
+        else:
+            out.append(f'{k} {v}')
+    print(', '.join(out))
+
+
+def open_sock(args):
+    # cdnet python package of the cdbus_tools submodule
+    sys.path.append(os.path.join(os.path.dirname(__file__), 'cdbus_tools', 'pycdnet'))
+    from cdnet.dev.cdbus_serial import CDBusSerial
+    from cdnet.dispatch import CDNetIntf, CDNetSocket
+    dev = CDBusSerial(args.dev, baud=args.baud)
+    CDNetIntf(dev, mac=0x00)
+    return CDNetSocket(('', 0xcdcd))
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(usage=__doc__)
+    parser.add_argument('--dev', dest='dev', default='ttyACM0')
+    parser.add_argument('--baud', dest='baud', type=int, default=115200)
+    parser.add_argument('--addr', dest='addr', default='00:00:55')
+    parser.add_argument('--interval', dest='interval', type=float, default=1.0)
+    parser.add_argument('--bin', dest='bin')
+    args = parser.parse_args()
+
+    if args.bin:
+        with open(args.bin, 'rb') as f:
+            show(decode(f.read()))
+        sys.exit(0)
+
+    sock = open_sock(args)
+    sock.sendto(b'\x60', (args.addr, 13)) # start from zero
+    sock.recvfrom(timeout=1)
+    t_last = time.monotonic()
+
+    while True:
+        time.sleep(args.interval)
+        sock.sendto(b'\x60', (args.addr, 13))
+        dat, src = sock.recvfrom(timeout=1)
+        now = time.monotonic()
+        if not dat or dat[0] != 0x80:
+            print('no reply')
+            continue
+        show(decode(dat[1:]), now - t_last)
+        t_last = now
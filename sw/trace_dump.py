@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# Software License Agreement (BSD License)
+#
+# Copyright (c) 2018, DUKELEC, Inc.
+# All rights reserved.
+#
+# Author: Duke Fong <duke@dukelec.com>
+
+"""CDBUS Bridge trace decoder
+
+poll the trace ring of port 15, rebuild the text by the formats of the elf:
+  ./trace_dump.py --elf ../fw/build/cdbus_bridge.elf --dev /dev/ttyACM0
+
+decode saved records (the reply without the leading 0x80 and trace_lost):
+  ./trace_dump.py --elf ../fw/build/cdbus_bridge.elf --bin trace.bin
+"""
+
+import os
+import re
+import sys
+import time
+import struct
+from argparse import ArgumentParser
+
+
+def elf_section(path, name):
+    # return (addr, data) of a section, little endian elf32 or elf64
+    with open(path, 'rb') as f:
+        elf = f.read()
+    assert elf[:4] == b'\x7fELF' and elf[5] == 1, 'not a little endian elf'
+    if elf[4] == 1:
+        shoff, = struct.unpack_from('<I', elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x2e)
+        sh_fmt, addr_i, off_i, size_i = '<IIIIIIIIII', 3, 4, 5
+    else:
+        shoff, = struct.unpack_from('<Q', elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x3a)
+        sh_fmt, addr_i, off_i, size_i = '<IIQQQQIIQQ', 3, 4, 5
+    shs = [struct.unpack_from(sh_fmt, elf, shoff + i * shentsize) for i in range(shnum)]
+    strtab = shs[shstrndx]
+    for sh in shs:
+        n_ofs = strtab[off_i] + sh[0]
+        if elf[n_ofs:elf.index(b'\0', n_ofs)].decode() == name:
+            return sh[addr_i], elf[sh[off_i]:sh[off_i] + sh[size_i]]
+    raise ValueError(f'no {name} in {path}')
+
+
+class Formats:
+    def __init__(self, elf):
+        self.addr, self.dat = elf_section(elf, '.trace_fmt')
+
+    def get(self, fid):
+        ofs = (fid - self.addr) & 0xffff
+        if ofs >= len(self.dat):
+            return None
+        fmt = self.dat[ofs:self.dat.index(b'\0', ofs)].decode(errors='replace')
+        # c length modifiers and %p to python
+        fmt = re.sub(r'%([-+ #0-9.]*)(hh|h|ll|l|z)?([diuxXc])', r'%\1\3', fmt)
+        fmt = fmt.replace('%p', '0x%08x')
+        return fmt, re.findall(r'%[-+ #0-9.]*([diuxXc])', fmt)
+
+
+def decode(dat, fmts, mhz):
+    # yield the text of each record
+    words = struct.unpack(f'<{len(dat) // 4}I', dat[:len(dat) // 4 * 4])
+    i = 0
+    while i + 1 < len(words):
+        hdr, cyc = words[i], words[i + 1]
+        argc = (hdr >> 16) & 0xff
+        if hdr >> 24 != 0xcd or argc > 4:
+            yield f'bad record header {hdr:08x}'
+            return
+        args = words[i + 2:i + 2 + argc]
+        fmt, convs = fmts.get(hdr & 0xffff) or (None, [])
+        # the args are 32 bit words, signed for %d and %i
+        args = [a - (1 << 32) if c in 'di' and a >> 31 else a for a, c in zip(args, convs)]
+        try:
+            txt = fmt % tuple(args) if fmt else f'unknown id {hdr & 0xffff:04x} {args}'
+        except (TypeError, ValueError):
+            txt = f'{fmt!r} % {args}'
+        yield f'[{cyc / mhz / 1e6:10.6f}] {txt.rstrip()}'
+        i += 2 + argc
+
+
+def open_sock(args):
+    # cdnet python package of the cdbus_tools submodule
+    sys.path.append(os.path.join(os.path.dirname(__file__), 'cdbus_tools', 'pycdnet'))
+    from cdnet.dev.cdbus_serial import CDBusSerial
+    from cdnet.dispatch import CDNetIntf, CDNetSocket
+    dev = CDBusSerial(args.dev, baud=args.baud)
+    CDNetIntf(dev, mac=0x00)
+    return CDNetSocket(('', 0xcdcd))
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser(usage=__doc__)
+    parser.add_argument('--elf', dest='elf', required=True)
+    parser.add_argument('--dev', dest='dev', default='ttyACM0')
+    parser.add_argument('--baud', dest='baud', type=int, default=115200)
+    parser.add_argument('--addr', dest='addr', default='00:00:55')
+    parser.add_argument('--mhz', dest='mhz', type=float, default=72) # cycles of the timestamps
+    parser.add_argument('--interval', dest='interval', type=float, default=0.1)
+    parser.add_argument('--bin', dest='bin')
+    args = parser.parse_args()
+
+    fmts = Formats(args.elf)
+
+    if args.bin:
+        with open(args.bin, 'rb') as f:
+            for line in decode(f.read(), fmts, args.mhz):
+                print(line)
+        sys.exit(0)
+
+    sock = open_sock(args)
+    lost_last = None
+
+    while True:
+        sock.sendto(b'\x40', (args.addr, 15))
+        dat, src = sock.recvfrom(timeout=1)
+        if not dat or dat[0] != 0x80:
+            print('no reply')
+            time.sleep(args.interval)
+            continue
+        lost, = struct.unpack('<I', dat[1:5])
+        if lost_last is not None and lost != lost_last:
+            print(f'--- {lost - lost_last} records lost ---')
+        lost_last = lost
+        for line in decode(dat[5:], fmts, args.mhz):
+            print(line)
+        if len(dat) == 5: # ring empty
+            time.sleep(args.interval)